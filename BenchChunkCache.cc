@@ -0,0 +1,100 @@
+/*
+ * A player walks back and forth along x, a few chunks each way, with
+ * RADIUS chunks either side of them loaded. Every chunk that comes into
+ * range has its blocks generated by Terrain into a SectionStorage, as
+ * Chunk::init does, or with a ChunkCache copied from the cache instead.
+ * Reports the time per chunk loaded, hits and misses, and what the cache
+ * held, for a few budgets; a budget of 0 caches nothing.
+ *
+ * g++ -std=c++20 -O3 BenchChunkCache.cc -o bench_chunk_cache
+ * ./bench_chunk_cache [steps] [swing]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <array>
+#include <chrono>
+#include <map>
+#include <memory>
+#include "ChunkCache.hh"
+#include "SectionStorage.hh"
+#include "Terrain.hh"
+
+using namespace std;
+using namespace std::chrono;
+
+static constexpr int RADIUS = 8;
+static constexpr std::uint32_t SEED = 1;
+
+typedef matan::SectionStorage<matan::Terrain::SECTION_COUNT> Blocks;
+
+static matan::PagePool& pagePool() {
+  static matan::PagePool pool(65536);
+  return pool;
+}
+
+//false if some section didn't fit in the pool.
+static bool generate(const matan::Terrain& terrain, int cx, Blocks& blocks) {
+  std::array<int, matan::Terrain::COLUMNS> heights;
+  std::array<unsigned char, matan::Terrain::SECTION_BLOCKS> ids;
+  terrain.heightmap(cx, heights.data());
+  bool complete = true;
+  for (int s = 0; s < matan::Terrain::SECTION_COUNT; ++s) {
+    terrain.section(cx, heights.data(), s, ids.data());
+    complete = blocks.encode(s * ids.size(), ids.size(), ids.data()) && complete;
+  }
+  return complete;
+}
+
+/*
+ * The player moves a chunk per step, turning around every swing chunks and
+ * drifting one chunk further each time, so most of what comes into range
+ * was in range a few steps ago and some of it is new.
+ */
+static void walk(size_t budget, int steps, int swing) {
+  const matan::Terrain terrain(SEED);
+  matan::ChunkCache<Blocks> cache(budget);
+  std::map<int, std::unique_ptr<Blocks>> loaded;
+  long loads = 0, sum = 0;
+  int player = 0, direction = 1, turn = swing;
+
+  auto start = high_resolution_clock::now();
+  for (int step = 0; step < steps; ++step) {
+    player += direction;
+    if (--turn == 0) {
+      direction = -direction;
+      turn = direction > 0 ? swing + 1 : swing;
+    }
+    for (auto it = loaded.begin(); it != loaded.end();) {
+      it = std::abs(it->first - player) > RADIUS ? loaded.erase(it) : std::next(it);
+    }
+    for (int cx = player - RADIUS; cx <= player + RADIUS; ++cx) {
+      if (loaded.count(cx)) {
+        continue;
+      }
+      auto blocks = std::make_unique<Blocks>(pagePool());
+      const matan::ChunkKey key{cx, SEED};
+      if (!cache.find(key, [&blocks](const Blocks& cached) { blocks->copyFrom(cached); })) {
+        if (generate(terrain, cx, *blocks)) {
+          cache.insert(key, *blocks, blocks->storedBytes());
+        }
+      }
+      sum += blocks->get(cx & 0xffff);
+      loaded.emplace(cx, std::move(blocks));
+      ++loads;
+    }
+  }
+  auto end = high_resolution_clock::now();
+  printf("%6zuKB budget %9.1f us/chunk  %6ld loads  %5lu hits  %5lu misses  %4d cached %6zuKB  (%ld)\n",
+         budget / 1024, duration_cast<nanoseconds>(end-start).count() / 1e3 / loads, loads,
+         cache.hits(), cache.misses(), cache.size(), cache.bytes() / 1024, sum);
+}
+
+int main(int argc, char* argv[]) {
+  const int steps = argc > 1 ? atoi(argv[1]) : 2000;
+  const int swing = argc > 2 ? atoi(argv[2]) : 6;
+  printf("%d steps, turning every %d, %d chunks loaded\n", steps, swing, 2 * RADIUS + 1);
+  for (size_t budget : {(size_t)0, (size_t)256 << 10, (size_t)1 << 20, (size_t)8 << 20}) {
+    walk(budget, steps, swing);
+  }
+}
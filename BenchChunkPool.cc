@@ -0,0 +1,208 @@
+/*
+ * Ways of replacing a chunk that fell out of range with a new one:
+ *  - delete it, erase it from a vector of pointers and push_back a new
+ *    Chunk, as NaiveGame.cc does
+ *  - destroy and construct it in place with matan::replace, as
+ *    GameOnHeap_TP_NoRealloc used to
+ *  - SlabPool release and acquire, which hands the same object back
+ *    through Chunk::reset
+ *  - the same, but acquired empty through reset() and then rebuilt, which
+ *    gives back every page first, as GameOnHeap_TP_NoRealloc used to
+ *  - reset(loc) on the chunk where it is, as GameOnHeap_TP_NoRealloc does
+ *
+ * The chunk is the game's minus the grid: sectioned blocks with a few
+ * stored sections, and 1000 entities in PagedArray columns, all on one
+ * PagePool. Each frame the first CHURN chunks go and as many new ones come.
+ *
+ * g++ -std=c++20 -O3 BenchChunkPool.cc -o bench_chunk_pool
+ * ./bench_chunk_pool [frames] [churn]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <vector>
+#include "SectionStorage.hh"
+#include "SlotMap.hh"
+#include "memory.hh"
+
+using namespace std;
+using namespace std::chrono;
+
+static constexpr int CHUNK_COUNT = 100;
+static constexpr int ENTITY_COUNT = 1000;
+static constexpr int SECTIONS = 16;
+//Sections of each chunk that hold more than one id.
+static constexpr int STORED_SECTIONS = 4;
+
+static matan::PagePool& pagePool() {
+  static matan::PagePool pool(16384);
+  return pool;
+}
+
+struct Chunk {
+  typedef matan::SectionStorage<SECTIONS> Blocks;
+  typedef matan::PagedArray<float, 4> Column;
+
+  Blocks blocks{pagePool()};
+  Column x{pagePool()}, y{pagePool()}, z{pagePool()};
+  int location = 0;
+
+  Chunk() = default;
+  explicit Chunk(int loc) { reset(loc); }
+  void reset() {
+    blocks.fill(0);
+    x.clear();
+    y.clear();
+    z.clear();
+  }
+  void reset(int loc) {
+    location = loc;
+    std::array<unsigned char, Blocks::SIZE / SECTIONS> ids;
+    for (int s = 0; s < SECTIONS; ++s) {
+      for (int i = 0; i < (int)ids.size(); ++i) {
+        ids[i] = s < STORED_SECTIONS ? (loc + i) % 4 : 0;
+      }
+      blocks.encode(s * ids.size(), ids.size(), ids.data());
+    }
+    //Over the columns' old pages, as EntityStore::copyFrom does.
+    x.resize(ENTITY_COUNT);
+    y.resize(ENTITY_COUNT);
+    z.resize(ENTITY_COUNT);
+    for (int i = 0; i < ENTITY_COUNT; ++i) {
+      x[i] = loc * 16.0f + i % 16;
+      y[i] = i;
+      z[i] = i;
+    }
+  }
+};
+
+static void report(const char* label, double ms, long sum) {
+  printf("%-18s %9.2f us/chunk  (%ld)\n", label, ms * 1e3, sum);
+}
+
+static long checksum(const Chunk& chunk) {
+  return chunk.location + chunk.blocks.get(1) + (long)chunk.x[ENTITY_COUNT - 1];
+}
+
+static void naive(int frames, int churn) {
+  std::vector<Chunk*> chunks;
+  int counter = 0;
+  for (int i = 0; i < CHUNK_COUNT; ++i) {
+    chunks.push_back(new Chunk(counter++));
+  }
+  long sum = 0;
+  auto start = high_resolution_clock::now();
+  for (int f = 0; f < frames; ++f) {
+    std::vector<Chunk*> toRemove(chunks.begin(), chunks.begin() + churn);
+    for (Chunk* chunk : toRemove) {
+      chunks.erase(std::find(chunks.begin(), chunks.end(), chunk));
+      chunks.push_back(new Chunk(counter++));
+      sum += checksum(*chunks.back());
+      delete chunk;
+    }
+  }
+  auto end = high_resolution_clock::now();
+  report("delete/new", duration_cast<nanoseconds>(end-start).count() / 1e6 / frames / churn, sum);
+  for (Chunk* chunk : chunks) {
+    delete chunk;
+  }
+}
+
+static void inPlace(int frames, int churn) {
+  auto chunks = new std::array<Chunk, CHUNK_COUNT>;
+  int counter = 0;
+  for (auto& chunk : *chunks) {
+    matan::replace(&chunk, counter++);
+  }
+  long sum = 0;
+  auto start = high_resolution_clock::now();
+  for (int f = 0; f < frames; ++f) {
+    for (int i = 0; i < churn; ++i) {
+      //Spread over the array like the game's slots.
+      Chunk& chunk = (*chunks)[(f * churn + i) % CHUNK_COUNT];
+      matan::replace(&chunk, counter++);
+      sum += checksum(chunk);
+    }
+  }
+  auto end = high_resolution_clock::now();
+  report("replace", duration_cast<nanoseconds>(end-start).count() / 1e6 / frames / churn, sum);
+  delete chunks;
+}
+
+static void pooled(int frames, int churn) {
+  matan::SlabPool<Chunk> pool;
+  std::array<Chunk*, CHUNK_COUNT> chunks;
+  int counter = 0;
+  for (auto& chunk : chunks) {
+    chunk = pool.acquire(counter++);
+  }
+  long sum = 0;
+  auto start = high_resolution_clock::now();
+  for (int f = 0; f < frames; ++f) {
+    for (int i = 0; i < churn; ++i) {
+      Chunk*& chunk = chunks[(f * churn + i) % CHUNK_COUNT];
+      pool.release(chunk);
+      chunk = pool.acquire(counter++);
+      sum += checksum(*chunk);
+    }
+  }
+  auto end = high_resolution_clock::now();
+  report("SlabPool reset", duration_cast<nanoseconds>(end-start).count() / 1e6 / frames / churn, sum);
+  printf("  %d chunks constructed in %d slabs\n", pool.constructed(), pool.slabs());
+}
+
+static void emptied(int frames, int churn) {
+  matan::SlabPool<Chunk> pool;
+  std::array<Chunk*, CHUNK_COUNT> chunks;
+  int counter = 0;
+  for (auto& chunk : chunks) {
+    chunk = pool.acquire(counter++);
+  }
+  long sum = 0;
+  auto start = high_resolution_clock::now();
+  for (int f = 0; f < frames; ++f) {
+    for (int i = 0; i < churn; ++i) {
+      Chunk*& chunk = chunks[(f * churn + i) % CHUNK_COUNT];
+      pool.release(chunk);
+      chunk = pool.acquire();
+      chunk->reset(counter++);
+      sum += checksum(*chunk);
+    }
+  }
+  auto end = high_resolution_clock::now();
+  report("emptied, rebuilt", duration_cast<nanoseconds>(end-start).count() / 1e6 / frames / churn, sum);
+}
+
+static void resetInPlace(int frames, int churn) {
+  auto chunks = new std::array<Chunk, CHUNK_COUNT>;
+  int counter = 0;
+  for (auto& chunk : *chunks) {
+    chunk.reset(counter++);
+  }
+  long sum = 0;
+  auto start = high_resolution_clock::now();
+  for (int f = 0; f < frames; ++f) {
+    for (int i = 0; i < churn; ++i) {
+      Chunk& chunk = (*chunks)[(f * churn + i) % CHUNK_COUNT];
+      chunk.reset(counter++);
+      sum += checksum(chunk);
+    }
+  }
+  auto end = high_resolution_clock::now();
+  report("reset in place", duration_cast<nanoseconds>(end-start).count() / 1e6 / frames / churn, sum);
+  delete chunks;
+}
+
+int main(int argc, char* argv[]) {
+  const int frames = argc > 1 ? atoi(argv[1]) : 2000;
+  const int churn = argc > 2 ? atoi(argv[2]) : 5;
+  printf("%d chunks, %d replaced per frame, %d frames\n", CHUNK_COUNT, churn, frames);
+  naive(frames, churn);
+  inPlace(frames, churn);
+  pooled(frames, churn);
+  emptied(frames, churn);
+  resetInPlace(frames, churn);
+}
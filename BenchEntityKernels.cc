@@ -0,0 +1,168 @@
+/*
+ * Checks every entity update kernel this CPU can run against the scalar one,
+ * bit for bit, over column lengths that hit every tail, then times each on
+ * the game's working set: 100 chunks of 1000 entities, three axes. The per
+ * entity velocity kernels, the uniform ones archetypes use, and the 16 bit
+ * fixed point ones behind compact positions.
+ *
+ * Exits with 1 if any kernel disagrees with the scalar result.
+ *
+ * g++ -std=c++20 -O3 BenchEntityKernels.cc -o bench_entity_kernels
+ * ./bench_entity_kernels [frames]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "EntityKernels.hh"
+
+using namespace std;
+using namespace std::chrono;
+
+static const int CHUNKS = 100;
+static const int ENTITIES = 1000;
+
+static bool matchesScalar(matan::AdvanceFn kernel) {
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> dist(-1000.0f, 1000.0f);
+  for (int n = 0; n <= 67; ++n) {
+    for (float dt : {1.0f, 0.016f, 0.333f}) {
+      std::vector<float> vel(n), expected(n);
+      for (int i = 0; i < n; ++i) {
+        vel[i] = dist(rng);
+        expected[i] = dist(rng);
+      }
+      std::vector<float> actual = expected;
+      matan::kernels::advanceScalar(expected.data(), vel.data(), dt, n);
+      kernel(actual.data(), vel.data(), dt, n);
+      if (n > 0 && memcmp(expected.data(), actual.data(), n * sizeof(float)) != 0) {
+        printf("  mismatch at n=%d dt=%f\n", n, dt);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static bool matchesScalar(matan::AdvanceUniformFn kernel) {
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> dist(-1000.0f, 1000.0f);
+  for (int n = 0; n <= 67; ++n) {
+    for (float step : {0.5f, 0.75f * 0.016f, 1.0f / 3.0f}) {
+      std::vector<float> expected(n);
+      for (int i = 0; i < n; ++i) {
+        expected[i] = dist(rng);
+      }
+      std::vector<float> actual = expected;
+      matan::kernels::advanceUniformScalar(expected.data(), step, n);
+      kernel(actual.data(), step, n);
+      if (n > 0 && memcmp(expected.data(), actual.data(), n * sizeof(float)) != 0) {
+        printf("  mismatch at n=%d step=%f\n", n, step);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static bool matchesScalar(matan::AdvanceFixedFn kernel) {
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> dist(-32768, 32767);
+  for (int n = 0; n <= 67; ++n) {
+    //The last one wraps.
+    for (std::int16_t step : {(std::int16_t)16, (std::int16_t)-3, (std::int16_t)32767}) {
+      std::vector<std::int16_t> expected(n);
+      for (int i = 0; i < n; ++i) {
+        expected[i] = (std::int16_t)dist(rng);
+      }
+      std::vector<std::int16_t> actual = expected;
+      matan::kernels::advanceFixedScalar(expected.data(), step, n);
+      kernel(actual.data(), step, n);
+      if (n > 0 && memcmp(expected.data(), actual.data(), n * sizeof(std::int16_t)) != 0) {
+        printf("  mismatch at n=%d step=%d\n", n, step);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static double timeKernel(matan::AdvanceFn kernel, int frames) {
+  //One column per axis per chunk, like EntityStore.
+  std::vector<float> pos(CHUNKS * 3 * ENTITIES, 0.0f);
+  std::vector<float> vel(CHUNKS * 3 * ENTITIES, 0.5f);
+  auto start = high_resolution_clock::now();
+  for (int frame = 0; frame < frames; ++frame) {
+    for (int column = 0; column < CHUNKS * 3; ++column) {
+      kernel(&pos[column * ENTITIES], &vel[column * ENTITIES], 1.0f, ENTITIES);
+    }
+  }
+  auto end = high_resolution_clock::now();
+  //Keep the stores alive.
+  volatile float sink = pos[ENTITIES - 1];
+  (void)sink;
+  return duration_cast<nanoseconds>(end-start).count() / 1e6 / frames;
+}
+
+static double timeKernel(matan::AdvanceUniformFn kernel, int frames) {
+  std::vector<float> pos(CHUNKS * 3 * ENTITIES, 0.0f);
+  auto start = high_resolution_clock::now();
+  for (int frame = 0; frame < frames; ++frame) {
+    for (int column = 0; column < CHUNKS * 3; ++column) {
+      kernel(&pos[column * ENTITIES], 0.5f, ENTITIES);
+    }
+  }
+  auto end = high_resolution_clock::now();
+  volatile float sink = pos[ENTITIES - 1];
+  (void)sink;
+  return duration_cast<nanoseconds>(end-start).count() / 1e6 / frames;
+}
+
+static double timeKernel(matan::AdvanceFixedFn kernel, int frames) {
+  std::vector<std::int16_t> pos(CHUNKS * 3 * ENTITIES, 0);
+  auto start = high_resolution_clock::now();
+  for (int frame = 0; frame < frames; ++frame) {
+    for (int column = 0; column < CHUNKS * 3; ++column) {
+      kernel(&pos[column * ENTITIES], 16, ENTITIES);
+    }
+  }
+  auto end = high_resolution_clock::now();
+  volatile std::int16_t sink = pos[ENTITIES - 1];
+  (void)sink;
+  return duration_cast<nanoseconds>(end-start).count() / 1e6 / frames;
+}
+
+template<class Kernel>
+static bool run(const char* label, matan::Isa isa, Kernel kernel, int frames) {
+  if (!kernel) {
+    printf("%-8s %-8s not supported\n", label, matan::isaName(isa));
+    return true;
+  }
+  const bool match = matchesScalar(kernel);
+  printf("%-8s %-8s %s   %8.4f ms/frame\n", label, matan::isaName(isa),
+         match ? "matches scalar" : "MISMATCH      ", timeKernel(kernel, frames));
+  return match;
+}
+
+int main(int argc, char* argv[]) {
+  const int frames = argc > 1 ? atoi(argv[1]) : 1000;
+  printf("best: %s, %d frames\n", matan::isaName(matan::bestIsa()), frames);
+
+  bool ok = true;
+  for (int i = 0; i < matan::ISA_COUNT; ++i) {
+    const matan::Isa isa = static_cast<matan::Isa>(i);
+    ok &= run("velocity", isa, matan::advanceKernel(isa), frames);
+  }
+  for (int i = 0; i < matan::ISA_COUNT; ++i) {
+    const matan::Isa isa = static_cast<matan::Isa>(i);
+    ok &= run("uniform", isa, matan::advanceUniformKernel(isa), frames);
+  }
+  for (int i = 0; i < matan::ISA_COUNT; ++i) {
+    const matan::Isa isa = static_cast<matan::Isa>(i);
+    ok &= run("fixed", isa, matan::advanceFixedKernel(isa), frames);
+  }
+  return ok ? 0 : 1;
+}
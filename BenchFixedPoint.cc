@@ -0,0 +1,134 @@
+/*
+ * Float against 16 bit fixed point entity positions (FixedPoint.hh, what
+ * -DMATAN_COMPACT_POSITIONS switches the game to).
+ *
+ * Throughput: the game's working set, 100 chunks of 1000 entities, three
+ * axes, moved a uniform step per frame; float PagedArray columns through
+ * advanceUniform against FixedColumn::advance.
+ *
+ * Drift: one entity moved by a step a million times, against the exact sum
+ * in double. Float accumulates in world space like the game does; fixed
+ * once with the step rounded to whole units up front, and once through
+ * FixedColumn, which carries the rounding over to the next tick.
+ *
+ * g++ -std=c++20 -O3 BenchFixedPoint.cc -o bench_fixed_point
+ * ./bench_fixed_point [frames] [ticks]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include "EntityKernels.hh"
+#include "FixedPoint.hh"
+
+using namespace std;
+using namespace std::chrono;
+
+static const int CHUNKS = 100;
+static const int ENTITIES = 1000;
+static const int COLUMNS = CHUNKS * 3;
+static const int MAX_PAGES = 4;
+typedef matan::PagedArray<float, MAX_PAGES> FloatColumn;
+typedef matan::FixedColumn<MAX_PAGES> FixedColumn;
+typedef FixedColumn::Format Format;
+
+static void reportThroughput(const char* label, double ms, size_t bytesPerElement) {
+  //Each position is read and written once a frame.
+  const double bytes = 2.0 * COLUMNS * ENTITIES * bytesPerElement;
+  printf("%-6s %8.4f ms/frame  %6.2f GB/s  %7.0f KB/frame\n",
+         label, ms, bytes / (ms / 1e3) / 1e9, bytes / 1024);
+}
+
+static double timeFloat(matan::PagePool& pool, int frames) {
+  std::vector<std::unique_ptr<FloatColumn>> columns;
+  for (int c = 0; c < COLUMNS; ++c) {
+    columns.emplace_back(new FloatColumn(pool));
+    for (int i = 0; i < ENTITIES; ++i) {
+      columns.back()->push_back((float)(i % 16));
+    }
+  }
+  auto start = high_resolution_clock::now();
+  for (int frame = 0; frame < frames; ++frame) {
+    for (auto& column : columns) {
+      for (int p = 0; p < column->pageCount(); ++p) {
+        matan::advanceUniform(column->page(p), 0.75f, column->pageSize(p));
+      }
+    }
+  }
+  auto end = high_resolution_clock::now();
+  volatile float sink = (*columns[0])[0];
+  (void)sink;
+  return duration_cast<nanoseconds>(end-start).count() / 1e6 / frames;
+}
+
+static double timeFixed(matan::PagePool& pool, int frames) {
+  std::vector<std::unique_ptr<FixedColumn>> columns;
+  for (int c = 0; c < COLUMNS; ++c) {
+    columns.emplace_back(new FixedColumn(pool));
+    for (int i = 0; i < ENTITIES; ++i) {
+      columns.back()->push_back((float)(i % 16));
+    }
+  }
+  auto start = high_resolution_clock::now();
+  for (int frame = 0; frame < frames; ++frame) {
+    for (auto& column : columns) {
+      column->advance(0.75f);
+    }
+  }
+  auto end = high_resolution_clock::now();
+  volatile float sink = columns[0]->get(0);
+  (void)sink;
+  return duration_cast<nanoseconds>(end-start).count() / 1e6 / frames;
+}
+
+struct Drift {
+  double worst;
+  double last;
+};
+
+static void track(Drift& drift, double error) {
+  drift.worst = std::max(drift.worst, std::fabs(error));
+  drift.last = error;
+}
+
+static void drift(matan::PagePool& pool, float start, float step, long ticks) {
+  float world = start;
+  std::int64_t rounded = Format::toUnits(start);
+  const std::int64_t roundedStep = Format::toUnits(step);
+  FixedColumn column(pool);
+  column.setAnchor(start);
+  column.push_back(start);
+
+  Drift floats = {0, 0}, once = {0, 0}, carried = {0, 0};
+  for (long tick = 1; tick <= ticks; ++tick) {
+    matan::advanceUniform(&world, step, 1);
+    rounded += roundedStep;
+    column.advance(step);
+    const double exact = (double)start + (double)step * tick;
+    track(floats, world - exact);
+    track(once, rounded * (double)Format::UNIT - exact);
+    track(carried, column.get(0) - exact);
+  }
+  printf("step %-10.7g float %10.4f/%-10.4f  rounded once %10.4f/%-10.4f  "
+         "carried %8.4f/%-8.4f\n", step, floats.worst, floats.last,
+         once.worst, once.last, carried.worst, carried.last);
+}
+
+int main(int argc, char* argv[]) {
+  const int frames = argc > 1 ? atoi(argv[1]) : 1000;
+  const long ticks = argc > 2 ? atol(argv[2]) : 1000000;
+  matan::PagePool pool(2 * COLUMNS * MAX_PAGES);
+
+  printf("-- throughput, %d frames\n", frames);
+  reportThroughput("float", timeFloat(pool, frames), sizeof(float));
+  reportThroughput("fixed", timeFixed(pool, frames), sizeof(std::int16_t));
+
+  printf("-- drift after %ld ticks from x=1600.3, worst/final error in blocks\n", ticks);
+  for (float step : {0.5f, 0.75f, 0.1f, 1.0f / 3.0f, 0.75f * 0.016f}) {
+    drift(pool, 1600.3f, step, ticks);
+  }
+  printf("(one unit is %g blocks)\n", Format::UNIT);
+}
@@ -0,0 +1,152 @@
+/*
+ * Producer contention on the task queue: the mutex protected TaskQueue the
+ * Shared ThreadPool uses, against the lock-free MPMCQueue behind LockFree.
+ *
+ * For 1, 2, 4, 8 and 16 producers it reports throughput and the worst
+ * single push, first on the bare queues, then through ThreadPool::enqueue
+ * with all the producers submitting to one pool.
+ *
+ * g++ -std=c++20 -O3 -pthread BenchMPMCQueue.cc -o bench_mpmc
+ * ./bench_mpmc [consumers] [tasks]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include "ThreadPool.hh"
+#include "MPMCQueue.hh"
+
+using namespace std;
+using namespace std::chrono;
+
+class LockedQueue {
+public:
+  bool tryPush(matan::Task&& task) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tasks.push_back(std::move(task));
+    return true;
+  }
+  bool tryPop(matan::Task& task) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_tasks.empty()) {
+      return false;
+    }
+    task = m_tasks.pop_front();
+    return true;
+  }
+
+private:
+  std::mutex m_mutex;
+  matan::TaskQueue m_tasks;
+};
+
+struct Result {
+  double mtasksPerSecond;
+  double worstPushUs;
+};
+
+static void report(const char* label, int producers, Result r) {
+  printf("%-10s %2d producers %8.2f Mtasks/s   worst push %9.2f us\n",
+         label, producers, r.mtasksPerSecond, r.worstPushUs);
+}
+
+template<class Queue>
+static Result runQueue(Queue& queue, int producers, int consumers, int tasks) {
+  std::atomic_long sum(0);
+  std::atomic_int consumed(0);
+  std::vector<double> worst(producers, 0);
+  std::vector<std::thread> threads;
+  const int perProducer = tasks / producers;
+  const int total = perProducer * producers;
+
+  auto start = high_resolution_clock::now();
+  for (int c = 0; c < consumers; ++c) {
+    threads.emplace_back([&]() {
+      matan::Task task;
+      while (consumed < total) {
+        if (queue.tryPop(task)) {
+          task();
+          task.reset();
+          ++consumed;
+        }
+      }
+    });
+  }
+  for (int p = 0; p < producers; ++p) {
+    threads.emplace_back([&, p]() {
+      for (int i = 0; i < perProducer; ++i) {
+        auto before = high_resolution_clock::now();
+        matan::Task task([&sum, i]() { sum += i; });
+        while (!queue.tryPush(std::move(task))) {
+          std::this_thread::yield();
+        }
+        auto after = high_resolution_clock::now();
+        worst[p] = std::max(worst[p], duration_cast<nanoseconds>(after-before).count() / 1000.0);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  auto end = high_resolution_clock::now();
+
+  double seconds = duration_cast<nanoseconds>(end-start).count() / 1e9;
+  return {total / seconds / 1e6, *std::max_element(worst.begin(), worst.end())};
+}
+
+static Result runPool(matan::ThreadPool::Scheduling scheduling,
+                      int producers, int consumers, int tasks) {
+  matan::ThreadPool pool(consumers, scheduling, 1 << 16);
+  std::atomic_long sum(0);
+  std::vector<double> worst(producers, 0);
+  std::vector<std::thread> threads;
+  const int perProducer = tasks / producers;
+
+  auto start = high_resolution_clock::now();
+  for (int p = 0; p < producers; ++p) {
+    threads.emplace_back([&, p]() {
+      for (int i = 0; i < perProducer; ++i) {
+        auto before = high_resolution_clock::now();
+        pool.enqueue([&sum](int k) { sum += k; }, i);
+        auto after = high_resolution_clock::now();
+        worst[p] = std::max(worst[p], duration_cast<nanoseconds>(after-before).count() / 1000.0);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  pool.waitFinished();
+  auto end = high_resolution_clock::now();
+
+  double seconds = duration_cast<nanoseconds>(end-start).count() / 1e9;
+  return {perProducer * producers / seconds / 1e6,
+          *std::max_element(worst.begin(), worst.end())};
+}
+
+int main(int argc, char* argv[]) {
+  const int consumers = argc > 1 ? atoi(argv[1]) : 4;
+  const int tasks = argc > 2 ? atoi(argv[2]) : 1 << 20;
+  const int producerCounts[] = {1, 2, 4, 8, 16};
+  printf("%d consumers, %d tasks\n", consumers, tasks);
+
+  printf("-- bare queues\n");
+  for (int producers : producerCounts) {
+    LockedQueue locked;
+    report("mutex", producers, runQueue(locked, producers, consumers, tasks));
+    matan::MPMCQueue<matan::Task> ring(1 << 16);
+    report("lock-free", producers, runQueue(ring, producers, consumers, tasks));
+  }
+
+  printf("-- ThreadPool::enqueue\n");
+  for (int producers : producerCounts) {
+    report("Shared", producers,
+           runPool(matan::ThreadPool::Scheduling::Shared, producers, consumers, tasks));
+    report("LockFree", producers,
+           runPool(matan::ThreadPool::Scheduling::LockFree, producers, consumers, tasks));
+  }
+}
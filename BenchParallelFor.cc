@@ -0,0 +1,140 @@
+/*
+ * Compares ways of spreading Game::updateChunks over threads:
+ *  - one ThreadPool::enqueue per chunk, as GameOnHeap_TP_NoRealloc used to
+ *  - ThreadPool::parallel_for with each partitioner
+ *  - #pragma omp parallel for, as in FasterGameOMP
+ *
+ * The chunk is the entity half of the game's Chunk, which is the part
+ * updateChunks actually touches every frame.
+ *
+ * g++ -std=c++20 -O3 -pthread -fopenmp BenchParallelFor.cc -o bench_parallel_for
+ * ./bench_parallel_for [threads] [frames]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <array>
+#include <functional>
+#include "ThreadPool.hh"
+
+using namespace std;
+using namespace std::chrono;
+
+struct Vector {
+  float x, y, z;
+};
+
+struct Entity {
+  Vector m_location;
+  Vector speed;
+  const char* name;
+  int health;
+
+  void updatePosition() {
+    m_location.x = m_location.x + 1.0f * speed.x;
+    m_location.y = m_location.y + 1.0f * speed.y;
+    m_location.z = m_location.z + 1.0f * speed.z;
+  }
+};
+
+struct Chunk {
+  std::array<Entity, 1000> entities;
+
+  void init(int seed) {
+    for (std::size_t i = 0; i < entities.size(); ++i) {
+      const float f = seed + i;
+      entities[i] = Entity{{f, f, f}, {0.5f, 0.25f * (i % 4), 0.75f}, "", 50};
+    }
+  }
+
+  void processEntities() {
+    for (std::size_t i = 0; i < entities.size(); i+=4) {
+      entities[i].updatePosition();
+      entities[i+1].updatePosition();
+      entities[i+2].updatePosition();
+      entities[i+3].updatePosition();
+    }
+  }
+};
+
+static constexpr int CHUNK_COUNT = 100;
+
+static void update(Chunk& chunk) {
+  chunk.processEntities();
+}
+
+static double run(const char* label,
+                  int frames,
+                  std::array<Chunk, CHUNK_COUNT>& chunks,
+                  const std::function<void()>& updateChunks) {
+  for (std::size_t i = 0; i < chunks.size(); ++i) {
+    chunks[i].init(i);
+  }
+  //warm up the threads and the caches
+  for (int f = 0; f < 10; ++f) {
+    updateChunks();
+  }
+
+  auto start = high_resolution_clock::now();
+  for (int f = 0; f < frames; ++f) {
+    updateChunks();
+  }
+  auto end = high_resolution_clock::now();
+
+  double ms = duration_cast<nanoseconds>(end-start).count() / 1000000.0 / frames;
+  printf("%-28s %f ms/frame\n", label, ms);
+  return ms;
+}
+
+int main(int argc, char* argv[]) {
+  const unsigned int threads = argc > 1 ? atoi(argv[1]) : thread::hardware_concurrency();
+  const int frames = argc > 2 ? atoi(argv[2]) : 2000;
+  auto chunks = new std::array<Chunk, CHUNK_COUNT>;
+  printf("%u threads, %d chunks, %d frames\n", threads, CHUNK_COUNT, frames);
+
+  {
+    matan::ThreadPool pool(threads, matan::ThreadPool::Scheduling::Shared);
+    run("enqueue per chunk (shared)", frames, *chunks, [&]() {
+      for (int i = 0; i < CHUNK_COUNT; ++i) {
+        pool.enqueue(update, std::ref((*chunks)[i]));
+      }
+      pool.waitFinished();
+    });
+  }
+
+  matan::ThreadPool pool(threads, matan::ThreadPool::Scheduling::WorkStealing);
+  run("enqueue per chunk (stealing)", frames, *chunks, [&]() {
+    for (int i = 0; i < CHUNK_COUNT; ++i) {
+      pool.enqueue(update, std::ref((*chunks)[i]));
+    }
+    pool.waitFinished();
+  });
+
+  const std::pair<const char*, matan::ThreadPool::Partitioner> partitioners[] = {
+    {"parallel_for static", matan::ThreadPool::Partitioner::Static},
+    {"parallel_for dynamic", matan::ThreadPool::Partitioner::Dynamic},
+    {"parallel_for guided", matan::ThreadPool::Partitioner::Guided},
+    {"parallel_for affine", matan::ThreadPool::Partitioner::Affine},
+  };
+  for (auto& p : partitioners) {
+    run(p.first, frames, *chunks, [&]() {
+      pool.parallel_for(0, CHUNK_COUNT, 1, [&](int i) {
+        update((*chunks)[i]);
+      }, p.second);
+    });
+  }
+
+#ifdef _OPENMP
+  run("omp parallel for", frames, *chunks, [&]() {
+#pragma omp parallel for num_threads(threads)
+    for (int i = 0; i < CHUNK_COUNT; ++i) {
+      update((*chunks)[i]);
+    }
+  });
+#else
+  printf("omp parallel for             (build with -fopenmp)\n");
+#endif
+
+  delete chunks;
+}
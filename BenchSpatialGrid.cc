@@ -0,0 +1,223 @@
+/*
+ * Keeping a chunk's SpatialGrid current as its entities move: rebuilding it
+ * with build() after every tick, as Chunk::indexEntities does, against
+ * updating it incrementally, moving only the entities whose cell changed
+ * from one bucket to another.
+ *
+ * The incremental grid hashes cells to the same buckets, but gives each
+ * bucket a vector of its own and remembers where every entity sits, so a
+ * move is a swap-remove from one bucket and a push onto another. An entity
+ * that stays in its cell still has its entry's position rewritten.
+ *
+ * One chunk's worth of entities, the game's four speeds and its 4 block
+ * cells, ticked 1, 2, 4 and 8 frames at a time as Game's tiers do. Each
+ * update is followed by the radius query Game::forEachEntityNear runs.
+ *
+ * g++ -std=c++20 -O3 BenchSpatialGrid.cc -o bench_spatial_grid
+ * ./bench_spatial_grid [entities] [ticks]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <vector>
+#include "SpatialGrid.hh"
+
+using namespace std;
+using namespace std::chrono;
+
+static constexpr int BUCKETS = 1024;
+static constexpr float CELL = 4.0f;
+static constexpr float RADIUS = 32.0f;
+static constexpr float SPEED[4][3] = {{0.5f, 0.0f, 0.5f}, {0.75f, 0.25f, 0.75f},
+                                      {0.75f, 0.0f, 0.75f}, {1.0f, 1.0f, 1.0f}};
+
+struct Entities {
+  std::vector<float> x, y, z;
+
+  explicit Entities(int n) : x(n), y(n), z(n) {
+    for (int i = 0; i < n; ++i) {
+      x[i] = i % 16;
+      y[i] = i;
+      z[i] = i;
+    }
+  }
+  int size() const { return x.size(); };
+  void update(float dt) {
+    for (int i = 0; i < size(); ++i) {
+      x[i] += SPEED[i % 4][0] * dt;
+      y[i] += SPEED[i % 4][1] * dt;
+      z[i] += SPEED[i % 4][2] * dt;
+    }
+  }
+};
+
+//Buckets that entities move between, the alternative to rebuilding.
+class IncrementalGrid {
+public:
+  explicit IncrementalGrid(const Entities& entities) :
+      m_buckets(BUCKETS), m_where(entities.size()) {
+    for (int i = 0; i < entities.size(); ++i) {
+      const std::uint32_t b = bucketOf(entities.x[i], entities.y[i], entities.z[i]);
+      m_where[i] = {b, (int)m_buckets[b].size()};
+      m_buckets[b].push_back({entities.x[i], entities.y[i], entities.z[i], (std::uint32_t)i});
+      include(m_buckets[b].back());
+    }
+  }
+
+  void update(const Entities& entities) {
+    std::fill(m_min, m_min + 3, std::numeric_limits<float>::max());
+    std::fill(m_max, m_max + 3, std::numeric_limits<float>::lowest());
+    for (int i = 0; i < entities.size(); ++i) {
+      const matan::GridEntry entry{entities.x[i], entities.y[i], entities.z[i], (std::uint32_t)i};
+      include(entry);
+      const std::uint32_t b = bucketOf(entry.x, entry.y, entry.z);
+      Where& where = m_where[i];
+      if (b == where.bucket) {
+        m_buckets[b][where.index] = entry;
+        continue;
+      }
+      auto& from = m_buckets[where.bucket];
+      from[where.index] = from.back();
+      m_where[from.back().id].index = where.index;
+      from.pop_back();
+      where = {b, (int)m_buckets[b].size()};
+      m_buckets[b].push_back(entry);
+    }
+  }
+
+  //Clipped to the bounds, and a full scan past BUCKETS cells, as SpatialGrid.
+  template<class F>
+  void forEachInRadius(float x, float y, float z, float radius, F&& f) const {
+    const float r2 = radius * radius;
+    auto visit = [&](const matan::GridEntry& e) {
+      const float dx = e.x - x, dy = e.y - y, dz = e.z - z;
+      if (dx*dx + dy*dy + dz*dz <= r2) {
+        f(e);
+      }
+    };
+    const int x0 = cell(std::max(x - radius, m_min[0])), x1 = cell(std::min(x + radius, m_max[0]));
+    const int y0 = cell(std::max(y - radius, m_min[1])), y1 = cell(std::min(y + radius, m_max[1]));
+    const int z0 = cell(std::max(z - radius, m_min[2])), z1 = cell(std::min(z + radius, m_max[2]));
+    if ((double)(x1 - x0 + 1) * (y1 - y0 + 1) * (z1 - z0 + 1) > BUCKETS) {
+      for (const auto& bucket : m_buckets) {
+        for (const matan::GridEntry& e : bucket) {
+          visit(e);
+        }
+      }
+      return;
+    }
+    for (int cx = x0; cx <= x1; ++cx) {
+      for (int cy = y0; cy <= y1; ++cy) {
+        for (int cz = z0; cz <= z1; ++cz) {
+          for (const matan::GridEntry& e : m_buckets[bucket(cx, cy, cz)]) {
+            if (cell(e.x) == cx && cell(e.y) == cy && cell(e.z) == cz) {
+              visit(e);
+            }
+          }
+        }
+      }
+    }
+  }
+
+private:
+  struct Where {
+    std::uint32_t bucket;
+    int index;
+  };
+
+  std::vector<std::vector<matan::GridEntry>> m_buckets;
+  std::vector<Where> m_where;
+  float m_min[3] = {std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                    std::numeric_limits<float>::max()};
+  float m_max[3] = {std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(),
+                    std::numeric_limits<float>::lowest()};
+
+  void include(const matan::GridEntry& e) {
+    m_min[0] = std::min(m_min[0], e.x);
+    m_min[1] = std::min(m_min[1], e.y);
+    m_min[2] = std::min(m_min[2], e.z);
+    m_max[0] = std::max(m_max[0], e.x);
+    m_max[1] = std::max(m_max[1], e.y);
+    m_max[2] = std::max(m_max[2], e.z);
+  }
+
+  //Same cells and hash as SpatialGrid.
+  static int cell(float v) {
+    const float scaled = v / CELL;
+    const int truncated = (int)scaled;
+    return truncated - (scaled < truncated);
+  }
+  static std::uint32_t bucket(int cx, int cy, int cz) {
+    return ((std::uint32_t)cx * 73856093u ^
+            (std::uint32_t)cy * 19349663u ^
+            (std::uint32_t)cz * 83492791u) & (BUCKETS - 1);
+  }
+  static std::uint32_t bucketOf(float x, float y, float z) {
+    return bucket(cell(x), cell(y), cell(z));
+  }
+};
+
+static void rebuild(matan::SpatialGrid<BUCKETS>& grid, const Entities& entities) {
+  grid.build([&entities](auto&& emit) {
+    for (int i = 0; i < entities.size(); ++i) {
+      emit(matan::GridEntry{entities.x[i], entities.y[i], entities.z[i], (std::uint32_t)i});
+    }
+  });
+}
+
+//Microseconds per tick spent keeping the index current, and querying it.
+static void report(const char* label, double indexNs, double queryNs, int ticks, long found) {
+  printf("  %-12s index %7.2f us  query %6.2f us  (%ld found)\n", label,
+         indexNs / 1e3 / ticks, queryNs / 1e3 / ticks, found);
+}
+
+int main(int argc, char* argv[]) {
+  const int count = argc > 1 ? atoi(argv[1]) : 1000;
+  const int ticks = argc > 2 ? atoi(argv[2]) : 20000;
+  printf("%d entities, %d ticks, cells of %.0f, radius %.0f queries\n", count, ticks, CELL, RADIUS);
+  for (float dt : {1.0f, 2.0f, 4.0f, 8.0f}) {
+    printf("dt %.0f\n", dt);
+    {
+      Entities entities(count);
+      matan::SpatialGrid<BUCKETS> grid(CELL);
+      rebuild(grid, entities);
+      double indexNs = 0, queryNs = 0;
+      long found = 0;
+      for (int t = 0; t < ticks; ++t) {
+        entities.update(dt);
+        auto start = high_resolution_clock::now();
+        rebuild(grid, entities);
+        auto mid = high_resolution_clock::now();
+        const int i = t % count;
+        grid.forEachInRadius(entities.x[i], entities.y[i], entities.z[i], RADIUS,
+                             [&found](const matan::GridEntry&) { ++found; });
+        auto end = high_resolution_clock::now();
+        indexNs += duration_cast<nanoseconds>(mid-start).count();
+        queryNs += duration_cast<nanoseconds>(end-mid).count();
+      }
+      report("rebuild", indexNs, queryNs, ticks, found);
+    }
+    {
+      Entities entities(count);
+      IncrementalGrid grid(entities);
+      double indexNs = 0, queryNs = 0;
+      long found = 0;
+      for (int t = 0; t < ticks; ++t) {
+        entities.update(dt);
+        auto start = high_resolution_clock::now();
+        grid.update(entities);
+        auto mid = high_resolution_clock::now();
+        const int i = t % count;
+        grid.forEachInRadius(entities.x[i], entities.y[i], entities.z[i], RADIUS,
+                             [&found](const matan::GridEntry&) { ++found; });
+        auto end = high_resolution_clock::now();
+        indexNs += duration_cast<nanoseconds>(mid-start).count();
+        queryNs += duration_cast<nanoseconds>(end-mid).count();
+      }
+      report("incremental", indexNs, queryNs, ticks, found);
+    }
+  }
+}
@@ -0,0 +1,103 @@
+/*
+ * Checks every noise row kernel this CPU can run against the scalar one,
+ * bit for bit, over row lengths that hit every tail and coordinates either
+ * side of 0, and whole chunks of Terrain built on each against Terrain on
+ * the scalar kernel. Then times Terrain::generate on each, one thread, in
+ * chunks per second per core.
+ *
+ * Exits with 1 if any kernel disagrees with the scalar result.
+ *
+ * g++ -std=c++20 -O3 BenchTerrain.cc -o bench_terrain
+ * ./bench_terrain [chunks] [seed]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "Terrain.hh"
+
+using namespace std;
+using namespace std::chrono;
+
+static bool matchesScalar(matan::NoiseRowFn kernel) {
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> coordinate(-5000.0f, 5000.0f);
+  for (int n = 0; n <= 67; ++n) {
+    for (float step : {1.0f / 128, 1.0f / 24, 0.37f}) {
+      const float x = coordinate(rng), y = coordinate(rng), z = coordinate(rng);
+      std::vector<float> expected(n, 0.25f);
+      std::vector<float> actual = expected;
+      matan::kernels::noiseRowScalar(7, x, step, y, z, 0.5f, expected.data(), n);
+      kernel(7, x, step, y, z, 0.5f, actual.data(), n);
+      if (n > 0 && memcmp(expected.data(), actual.data(), n * sizeof(float)) != 0) {
+        printf("  mismatch at n=%d x=%f step=%f\n", n, x, step);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static bool chunksMatch(const matan::Terrain& terrain, std::uint32_t seed) {
+  const matan::Terrain reference(seed, matan::Isa::Scalar);
+  std::vector<unsigned char> expected(matan::Terrain::BLOCKS), actual(matan::Terrain::BLOCKS);
+  for (int cx : {0, 1, -1, 37, -1000, 100000}) {
+    reference.generate(cx, expected.data());
+    terrain.generate(cx, actual.data());
+    if (expected != actual) {
+      printf("  chunk %d differs\n", cx);
+      return false;
+    }
+  }
+  return true;
+}
+
+//Microseconds per chunk.
+static double timeTerrain(const matan::Terrain& terrain, int chunks, long counts[256]) {
+  std::vector<unsigned char> blocks(matan::Terrain::BLOCKS);
+  auto start = high_resolution_clock::now();
+  for (int cx = 0; cx < chunks; ++cx) {
+    terrain.generate(cx, blocks.data());
+    for (unsigned char id : blocks) {
+      ++counts[id];
+    }
+  }
+  auto end = high_resolution_clock::now();
+  return duration_cast<nanoseconds>(end-start).count() / 1e3 / chunks;
+}
+
+int main(int argc, char* argv[]) {
+  const int chunks = argc > 1 ? atoi(argv[1]) : 200;
+  const std::uint32_t seed = argc > 2 ? (std::uint32_t)atol(argv[2]) : 1;
+  printf("best: %s, %d chunks, seed %u\n", matan::isaName(matan::bestIsa()), chunks, seed);
+
+  bool ok = true;
+  long counts[256] = {};
+  for (int i = 0; i < matan::ISA_COUNT; ++i) {
+    const matan::Isa isa = static_cast<matan::Isa>(i);
+    const matan::NoiseRowFn kernel = matan::noiseRowKernel(isa);
+    if (!kernel) {
+      printf("%-8s not supported\n", matan::isaName(isa));
+      continue;
+    }
+    const matan::Terrain terrain(seed, isa);
+    const bool match = matchesScalar(kernel) && chunksMatch(terrain, seed);
+    ok &= match;
+    std::fill(counts, counts + 256, 0);
+    const double us = timeTerrain(terrain, chunks, counts);
+    printf("%-8s %s   %8.1f us/chunk  %8.0f chunks/s/core\n", matan::isaName(isa),
+           match ? "matches scalar" : "MISMATCH      ", us, 1e6 / us);
+  }
+
+  const char* names[] = {"air", "stone", "dirt", "grass", "sand", "water", "bedrock"};
+  const double total = (double)chunks * matan::Terrain::BLOCKS;
+  printf("blocks:");
+  for (int id = 0; id < 7; ++id) {
+    printf(" %s %.1f%%", names[id], 100.0 * counts[id] / total);
+  }
+  printf("\n");
+  return ok ? 0 : 1;
+}
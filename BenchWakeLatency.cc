@@ -0,0 +1,59 @@
+/*
+ * How long an idle worker takes to pick up a task, by spin budget: the time
+ * from enqueue to the task starting, after the pool has sat idle for a gap.
+ * A gap shorter than the budget finds the workers still spinning, as the
+ * phases of a frame do with Game::SPIN_BUDGET; a longer one finds them
+ * parked, as the start of every frame does.
+ *
+ * The main thread sleeps through the gap and parks on the latch at once,
+ * so only the workers' side of the wake is timed and a spinning worker is
+ * never fighting it for a core.
+ *
+ * g++ -std=c++20 -O3 -pthread BenchWakeLatency.cc -o bench_wake_latency
+ * ./bench_wake_latency [wakes]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "ThreadPool.hh"
+
+using namespace std;
+using namespace std::chrono;
+
+static void measure(matan::ThreadPool& pool, microseconds gap, int wakes) {
+  std::vector<double> latencies;
+  latencies.reserve(wakes);
+  for (int i = 0; i < wakes; ++i) {
+    this_thread::sleep_for(gap);
+    matan::Latch done(1);
+    steady_clock::time_point started;
+    const auto enqueued = steady_clock::now();
+    pool.enqueue([&started, &done]() {
+      started = steady_clock::now();
+      done.countDown();
+    });
+    done.wait();
+    latencies.push_back(duration_cast<nanoseconds>(started - enqueued).count() / 1e3);
+  }
+  std::sort(latencies.begin(), latencies.end());
+  printf("  gap %5ldus  budget %4ldus  median %7.2fus  p99 %7.2fus\n", (long)gap.count(),
+         (long)duration_cast<microseconds>(pool.spinBudget()).count(),
+         latencies[wakes / 2], latencies[wakes * 99 / 100]);
+}
+
+int main(int argc, char* argv[]) {
+  const int wakes = argc > 1 ? atoi(argv[1]) : 2000;
+  matan::ThreadPool pool(std::thread::hardware_concurrency(),
+                         matan::ThreadPool::Scheduling::WorkStealing);
+  printf("%d workers, %d wakes each\n", pool.numThreads(), wakes);
+  for (microseconds gap : {microseconds(50), microseconds(2000)}) {
+    for (microseconds budget : {microseconds(0), microseconds(50), microseconds(200)}) {
+      pool.setSpinBudget(budget);
+      measure(pool, gap, wakes);
+    }
+  }
+}
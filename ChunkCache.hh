@@ -0,0 +1,194 @@
+/*
+ * Generated chunk contents by (chunk coordinate, world seed), least
+ * recently used first out once they add up to more than a byte budget.
+ * A chunk that comes back into range soon after it left, say with the
+ * player going back and forth over a chunk boundary, is then a copy of
+ * what was generated last time rather than generated again.
+ *
+ * Value is whatever the chunk keeps of its generated state. For blocks
+ * that's a SectionStorage, already compressed: uniform sections elided,
+ * the rest palette packed, and copying it only shares the sections. What
+ * each entry costs is given with it, since only the caller knows what a
+ * Value holds on to.
+ *
+ * Every call may come from any thread.
+ */
+
+#ifndef MATAN_CHUNKCACHE_HH
+#define MATAN_CHUNKCACHE_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+namespace matan {
+  struct ChunkKey {
+    int coordinate;
+    std::uint32_t seed;
+
+    bool operator==(const ChunkKey& other) const {
+      return coordinate == other.coordinate && seed == other.seed;
+    };
+  };
+
+  template<typename Value>
+  class ChunkCache {
+  public:
+    explicit ChunkCache(std::size_t budget) : m_budget(budget) {};
+    ChunkCache(const ChunkCache&) = delete;
+    ChunkCache& operator=(const ChunkCache&) = delete;
+    /*
+     * f(value) with the value cached for key and true, a hit, which makes it
+     * the most recently used. Otherwise false, a miss. f runs under the
+     * cache's lock, so it should only copy.
+     */
+    template<class F> bool find(ChunkKey key, F&& f);
+    //Caches a copy of value for key, in place of any there already, and
+    //drops the least recently used until they all fit in the budget. One
+    //that's bigger than the whole budget isn't kept.
+    void insert(ChunkKey key, const Value& value, std::size_t bytes);
+    //Drops entries until the rest fit.
+    void setBudget(std::size_t budget);
+    void clear();
+    std::size_t budget();
+    //What the cached entries cost, by what insert was told.
+    std::size_t bytes();
+    int size();
+    unsigned long hits();
+    unsigned long misses();
+    //Entries dropped to stay in budget.
+    unsigned long evictions();
+
+  private:
+    struct Entry {
+      ChunkKey key;
+      Value value;
+      std::size_t bytes;
+    };
+    struct KeyHash {
+      std::size_t operator()(const ChunkKey& key) const {
+        return std::hash<std::uint64_t>()(
+            (std::uint64_t)key.seed << 32 | (std::uint32_t)key.coordinate);
+      };
+    };
+    typedef std::list<Entry> Entries;
+
+    std::mutex m_mutex;
+    //Most recently used first.
+    Entries m_entries;
+    std::unordered_map<ChunkKey, typename Entries::iterator, KeyHash> m_index;
+    std::size_t m_budget;
+    std::size_t m_bytes = 0;
+    unsigned long m_hits = 0;
+    unsigned long m_misses = 0;
+    unsigned long m_evictions = 0;
+
+    void erase(typename Entries::iterator it);
+    //Drops from the back until m_bytes <= budget.
+    void shrink(std::size_t budget);
+  };
+
+  template<typename Value>
+  template<class F>
+  bool ChunkCache<Value>::find(ChunkKey key, F&& f) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto found = m_index.find(key);
+    if (found == m_index.end()) {
+      ++m_misses;
+      return false;
+    }
+    ++m_hits;
+    m_entries.splice(m_entries.begin(), m_entries, found->second);
+    f(static_cast<const Value&>(found->second->value));
+    return true;
+  }
+
+  template<typename Value>
+  void ChunkCache<Value>::insert(ChunkKey key, const Value& value, std::size_t bytes) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto found = m_index.find(key);
+    if (found != m_index.end()) {
+      erase(found->second);
+    }
+    if (bytes > m_budget) {
+      return;
+    }
+    shrink(m_budget - bytes);
+    m_entries.push_front(Entry{key, value, bytes});
+    m_index.emplace(key, m_entries.begin());
+    m_bytes += bytes;
+  }
+
+  template<typename Value>
+  void ChunkCache<Value>::setBudget(std::size_t budget) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_budget = budget;
+    shrink(budget);
+  }
+
+  template<typename Value>
+  void ChunkCache<Value>::clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_index.clear();
+    m_entries.clear();
+    m_bytes = 0;
+  }
+
+  template<typename Value>
+  void ChunkCache<Value>::erase(typename Entries::iterator it) {
+    m_bytes -= it->bytes;
+    m_index.erase(it->key);
+    m_entries.erase(it);
+  }
+
+  template<typename Value>
+  void ChunkCache<Value>::shrink(std::size_t budget) {
+    while (m_bytes > budget) {
+      erase(std::prev(m_entries.end()));
+      ++m_evictions;
+    }
+  }
+
+  template<typename Value>
+  std::size_t ChunkCache<Value>::budget() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_budget;
+  }
+
+  template<typename Value>
+  std::size_t ChunkCache<Value>::bytes() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_bytes;
+  }
+
+  template<typename Value>
+  int ChunkCache<Value>::size() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_entries.size();
+  }
+
+  template<typename Value>
+  unsigned long ChunkCache<Value>::hits() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_hits;
+  }
+
+  template<typename Value>
+  unsigned long ChunkCache<Value>::misses() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_misses;
+  }
+
+  template<typename Value>
+  unsigned long ChunkCache<Value>::evictions() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_evictions;
+  }
+}
+
+#endif //MATAN_CHUNKCACHE_HH
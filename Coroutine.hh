@@ -0,0 +1,231 @@
+/*
+ * C++20 coroutines on top of ThreadPool, for long jobs that should give the
+ * worker back every so often instead of hogging it for a whole frame.
+ *
+ * Job<T> is a lazily started coroutine returning T. Inside one you can
+ *   co_await resumeOn(pool)  - requeue yourself, letting queued work go first
+ *   co_await clock.nextFrame() - sleep until the next FrameClock::tick
+ *   co_await otherJob          - run another Job and take its result
+ * and whichever worker picks the coroutine up next resumes it.
+ *
+ * Start a Job with start(pool) and collect the result with get(), or hand
+ * it to detach(pool), after which it runs on its own and frees itself.
+ */
+
+#ifndef MATAN_COROUTINE_HH
+#define MATAN_COROUTINE_HH
+
+#if !defined(__cpp_impl_coroutine)
+#error "Coroutine.hh needs C++20 coroutines, build with -std=c++20"
+#endif
+
+#include <coroutine>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+#include "ThreadPool.hh"
+
+namespace matan {
+  template<class T = void> class Job;
+
+  namespace detail {
+    struct JobPromiseBase {
+      std::coroutine_handle<> continuation;
+      Latch done{1};
+      bool detached = false;
+
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      void unhandled_exception() { std::terminate(); }
+
+      struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template<class Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+          JobPromiseBase& promise = h.promise();
+          if (promise.detached) {
+            h.destroy();
+            return std::noop_coroutine();
+          }
+          //Grab it first, after countDown the Job may already be gone.
+          std::coroutine_handle<> next = promise.continuation;
+          promise.done.countDown();
+          return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+      };
+      FinalAwaiter final_suspend() noexcept { return {}; }
+    };
+
+    template<class T>
+    struct JobPromise : JobPromiseBase {
+      std::optional<T> value;
+      Job<T> get_return_object();
+      template<class U> void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+    };
+
+    template<>
+    struct JobPromise<void> : JobPromiseBase {
+      Job<void> get_return_object();
+      void return_void() {}
+    };
+  } //namespace detail
+
+  template<class T>
+  class Job {
+  public:
+    typedef detail::JobPromise<T> promise_type;
+
+    Job(Job&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+    Job& operator=(Job&& other) noexcept;
+    Job(const Job&) = delete;
+    ~Job();
+
+    //Queue the first resume on pool. Can only be called once.
+    void start(ThreadPool& pool,
+               ThreadPool::Priority priority = ThreadPool::Priority::Frame);
+    //Start it and forget it, the coroutine frees itself when it's done.
+    void detach(ThreadPool& pool,
+                ThreadPool::Priority priority = ThreadPool::Priority::Frame);
+    //Block until a started Job finishes. Returns the co_returned value.
+    decltype(auto) get();
+    bool done() { return m_handle.promise().done.tryWait(); };
+
+    //co_await job runs it on the awaiting thread and resumes us when done.
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept;
+    decltype(auto) await_resume();
+
+  private:
+    friend promise_type;
+    explicit Job(std::coroutine_handle<promise_type> h) : m_handle(h) {}
+    std::coroutine_handle<promise_type> m_handle;
+  };
+
+  template<class T>
+  Job<T> detail::JobPromise<T>::get_return_object() {
+    return Job<T>(std::coroutine_handle<JobPromise<T>>::from_promise(*this));
+  }
+
+  inline Job<void> detail::JobPromise<void>::get_return_object() {
+    return Job<void>(std::coroutine_handle<JobPromise<void>>::from_promise(*this));
+  }
+
+  template<class T>
+  Job<T>& Job<T>::operator=(Job&& other) noexcept {
+    if (this != &other) {
+      if (m_handle) {
+        m_handle.destroy();
+      }
+      m_handle = std::exchange(other.m_handle, nullptr);
+    }
+    return *this;
+  }
+
+  template<class T>
+  Job<T>::~Job() {
+    if (m_handle) {
+      m_handle.destroy();
+    }
+  }
+
+  template<class T>
+  void Job<T>::start(ThreadPool& pool, ThreadPool::Priority priority) {
+    std::coroutine_handle<> h = m_handle;
+    pool.enqueue(priority, [h]() { h.resume(); });
+  }
+
+  template<class T>
+  void Job<T>::detach(ThreadPool& pool, ThreadPool::Priority priority) {
+    m_handle.promise().detached = true;
+    std::coroutine_handle<> h = std::exchange(m_handle, nullptr);
+    pool.enqueue(priority, [h]() { h.resume(); });
+  }
+
+  template<class T>
+  decltype(auto) Job<T>::get() {
+    m_handle.promise().done.wait();
+    return await_resume();
+  }
+
+  template<class T>
+  std::coroutine_handle<> Job<T>::await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    m_handle.promise().continuation = awaiting;
+    return m_handle;
+  }
+
+  template<class T>
+  decltype(auto) Job<T>::await_resume() {
+    if constexpr (std::is_void<T>::value) {
+      return;
+    } else {
+      return std::move(*m_handle.promise().value);
+    }
+  }
+
+  /*
+   * co_await resumeOn(pool) puts the coroutine back on the pool's queue,
+   * so it continues on whichever worker gets to it.
+   */
+  struct ResumeOn {
+    ThreadPool& pool;
+    ThreadPool::Priority priority;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+      pool.enqueue(priority, [h]() { h.resume(); });
+    }
+    void await_resume() const noexcept {}
+  };
+
+  inline ResumeOn resumeOn(ThreadPool& pool,
+                           ThreadPool::Priority priority = ThreadPool::Priority::Frame) {
+    return {pool, priority};
+  }
+
+  /*
+   * A frame boundary coroutines can wait on. Whoever drives the frames calls
+   * tick() once a frame, which queues everything that awaited nextFrame()
+   * since the last tick.
+   */
+  class FrameClock {
+  public:
+    FrameClock(ThreadPool& pool,
+               ThreadPool::Priority priority = ThreadPool::Priority::Background) :
+        m_pool(pool), m_priority(priority) {}
+    void tick();
+
+    struct NextFrame {
+      FrameClock& clock;
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h);
+      void await_resume() const noexcept {}
+    };
+    NextFrame nextFrame() { return {*this}; };
+
+  private:
+    ThreadPool& m_pool;
+    const ThreadPool::Priority m_priority;
+    std::mutex m_mutex;
+    std::vector<std::coroutine_handle<>> m_waiting;
+    std::vector<std::coroutine_handle<>> m_resuming;
+  };
+
+  inline void FrameClock::NextFrame::await_suspend(std::coroutine_handle<> h) {
+    std::lock_guard<std::mutex> lock(clock.m_mutex);
+    clock.m_waiting.push_back(h);
+  }
+
+  inline void FrameClock::tick() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_resuming.swap(m_waiting);
+    }
+    for (auto h : m_resuming) {
+      m_pool.enqueue(m_priority, [h]() { h.resume(); });
+    }
+    m_resuming.clear();
+  }
+} //namespace matan
+
+#endif //MATAN_COROUTINE_HH
@@ -0,0 +1,287 @@
+/*
+ * The entity position update, pos[i] += vel[i] * dt over a column, and its
+ * uniform form pos[i] += step for columns whose entities all move alike, in
+ * a scalar version and SSE2, AVX2 and AVX-512 versions. Each SIMD version is
+ * compiled for its instruction set with a target attribute, so one binary
+ * carries all of them and advance() picks the widest the CPU has on first
+ * use. advanceUniform() does the same for the uniform kernels, and
+ * advanceFixed() for pos[i] += step on 16 bit fixed point columns (see
+ * FixedPoint.hh).
+ *
+ * None of them use FMA: a fused multiply-add rounds once where the scalar
+ * code rounds twice, and every path has to give the scalar result to the bit.
+ * GCC would happily fuse the separate multiply and add on its own (C++ gets
+ * -ffp-contract=fast), in the AVX-512 kernel and in any of them under
+ * -march=native, so contraction is switched off for this file.
+ * BenchEntityKernels.cc checks that they match.
+ */
+
+#ifndef MATAN_ENTITYKERNELS_HH
+#define MATAN_ENTITYKERNELS_HH
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MATAN_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+#include <cstdint>
+
+#if defined(__clang__)
+#define MATAN_NO_CONTRACT _Pragma("clang fp contract(off)")
+#else
+#define MATAN_NO_CONTRACT
+#endif
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+namespace matan {
+  enum class Isa { Scalar, SSE2, AVX2, AVX512 };
+  constexpr int ISA_COUNT = 4;
+
+  typedef void (*AdvanceFn)(float* pos, const float* vel, float dt, int n);
+  typedef void (*AdvanceUniformFn)(float* pos, float step, int n);
+  typedef void (*AdvanceFixedFn)(std::int16_t* pos, std::int16_t step, int n);
+
+  namespace kernels {
+    inline void advanceScalar(float* pos, const float* vel, float dt, int n) {
+      MATAN_NO_CONTRACT
+      for (int i = 0; i < n; ++i) {
+        pos[i] = pos[i] + vel[i] * dt;
+      }
+    }
+
+    inline void advanceUniformScalar(float* pos, float step, int n) {
+      MATAN_NO_CONTRACT
+      for (int i = 0; i < n; ++i) {
+        pos[i] = pos[i] + step;
+      }
+    }
+
+    //Wraps on overflow; FixedColumn rebases before it could happen.
+    inline void advanceFixedScalar(std::int16_t* pos, std::int16_t step, int n) {
+      for (int i = 0; i < n; ++i) {
+        pos[i] = (std::int16_t)(pos[i] + step);
+      }
+    }
+
+#ifdef MATAN_KERNELS_X86
+    __attribute__((target("sse2")))
+    inline void advanceSSE2(float* pos, const float* vel, float dt, int n) {
+      MATAN_NO_CONTRACT
+      const __m128 step = _mm_set1_ps(dt);
+      int i = 0;
+      for (; i + 4 <= n; i += 4) {
+        const __m128 v = _mm_mul_ps(_mm_loadu_ps(vel + i), step);
+        _mm_storeu_ps(pos + i, _mm_add_ps(_mm_loadu_ps(pos + i), v));
+      }
+      advanceScalar(pos + i, vel + i, dt, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    inline void advanceAVX2(float* pos, const float* vel, float dt, int n) {
+      MATAN_NO_CONTRACT
+      const __m256 step = _mm256_set1_ps(dt);
+      int i = 0;
+      for (; i + 8 <= n; i += 8) {
+        const __m256 v = _mm256_mul_ps(_mm256_loadu_ps(vel + i), step);
+        _mm256_storeu_ps(pos + i, _mm256_add_ps(_mm256_loadu_ps(pos + i), v));
+      }
+      advanceScalar(pos + i, vel + i, dt, n - i);
+    }
+
+    __attribute__((target("avx512f")))
+    inline void advanceAVX512(float* pos, const float* vel, float dt, int n) {
+      MATAN_NO_CONTRACT
+      const __m512 step = _mm512_set1_ps(dt);
+      int i = 0;
+      for (; i + 16 <= n; i += 16) {
+        const __m512 v = _mm512_mul_ps(_mm512_loadu_ps(vel + i), step);
+        _mm512_storeu_ps(pos + i, _mm512_add_ps(_mm512_loadu_ps(pos + i), v));
+      }
+      //The tail through a mask rather than the scalar loop.
+      const __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+      const __m512 v = _mm512_mul_ps(_mm512_maskz_loadu_ps(tail, vel + i), step);
+      _mm512_mask_storeu_ps(pos + i, tail,
+                            _mm512_add_ps(_mm512_maskz_loadu_ps(tail, pos + i), v));
+    }
+
+    __attribute__((target("sse2")))
+    inline void advanceUniformSSE2(float* pos, float step, int n) {
+      const __m128 v = _mm_set1_ps(step);
+      int i = 0;
+      for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(pos + i, _mm_add_ps(_mm_loadu_ps(pos + i), v));
+      }
+      advanceUniformScalar(pos + i, step, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    inline void advanceUniformAVX2(float* pos, float step, int n) {
+      const __m256 v = _mm256_set1_ps(step);
+      int i = 0;
+      for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(pos + i, _mm256_add_ps(_mm256_loadu_ps(pos + i), v));
+      }
+      advanceUniformScalar(pos + i, step, n - i);
+    }
+
+    __attribute__((target("avx512f")))
+    inline void advanceUniformAVX512(float* pos, float step, int n) {
+      const __m512 v = _mm512_set1_ps(step);
+      int i = 0;
+      for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(pos + i, _mm512_add_ps(_mm512_loadu_ps(pos + i), v));
+      }
+      const __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+      _mm512_mask_storeu_ps(pos + i, tail,
+                            _mm512_add_ps(_mm512_maskz_loadu_ps(tail, pos + i), v));
+    }
+
+    __attribute__((target("sse2")))
+    inline void advanceFixedSSE2(std::int16_t* pos, std::int16_t step, int n) {
+      const __m128i v = _mm_set1_epi16(step);
+      int i = 0;
+      for (; i + 8 <= n; i += 8) {
+        __m128i* p = reinterpret_cast<__m128i*>(pos + i);
+        _mm_storeu_si128(p, _mm_add_epi16(_mm_loadu_si128(p), v));
+      }
+      advanceFixedScalar(pos + i, step, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    inline void advanceFixedAVX2(std::int16_t* pos, std::int16_t step, int n) {
+      const __m256i v = _mm256_set1_epi16(step);
+      int i = 0;
+      for (; i + 16 <= n; i += 16) {
+        __m256i* p = reinterpret_cast<__m256i*>(pos + i);
+        _mm256_storeu_si256(p, _mm256_add_epi16(_mm256_loadu_si256(p), v));
+      }
+      advanceFixedScalar(pos + i, step, n - i);
+    }
+
+    //16 bit lanes are AVX-512BW, not in every AVX-512 CPU.
+    __attribute__((target("avx512f,avx512bw")))
+    inline void advanceFixedAVX512(std::int16_t* pos, std::int16_t step, int n) {
+      const __m512i v = _mm512_set1_epi16(step);
+      int i = 0;
+      for (; i + 32 <= n; i += 32) {
+        _mm512_storeu_si512(pos + i, _mm512_add_epi16(_mm512_loadu_si512(pos + i), v));
+      }
+      const __mmask32 tail = (__mmask32)((1ull << (n - i)) - 1);
+      _mm512_mask_storeu_epi16(pos + i, tail,
+                               _mm512_add_epi16(_mm512_maskz_loadu_epi16(tail, pos + i), v));
+    }
+#endif
+  } //namespace kernels
+
+  inline const char* isaName(Isa isa) {
+    switch (isa) {
+      case Isa::Scalar: return "scalar";
+      case Isa::SSE2: return "SSE2";
+      case Isa::AVX2: return "AVX2";
+      case Isa::AVX512: return "AVX-512";
+    }
+    return "?";
+  }
+
+  //Whether this CPU (and OS) can run isa.
+  inline bool isaSupported(Isa isa) {
+#ifdef MATAN_KERNELS_X86
+    switch (isa) {
+      case Isa::Scalar: return true;
+      case Isa::SSE2: return __builtin_cpu_supports("sse2");
+      case Isa::AVX2: return __builtin_cpu_supports("avx2");
+      case Isa::AVX512: return __builtin_cpu_supports("avx512f");
+    }
+    return false;
+#else
+    return isa == Isa::Scalar;
+#endif
+  }
+
+  inline Isa bestIsa() {
+    for (int isa = ISA_COUNT - 1; isa > 0; --isa) {
+      if (isaSupported(static_cast<Isa>(isa))) {
+        return static_cast<Isa>(isa);
+      }
+    }
+    return Isa::Scalar;
+  }
+
+  //The kernel for isa, or nullptr if it wasn't compiled in or can't run here.
+  inline AdvanceFn advanceKernel(Isa isa) {
+    if (!isaSupported(isa)) {
+      return nullptr;
+    }
+    switch (isa) {
+#ifdef MATAN_KERNELS_X86
+      case Isa::SSE2: return kernels::advanceSSE2;
+      case Isa::AVX2: return kernels::advanceAVX2;
+      case Isa::AVX512: return kernels::advanceAVX512;
+#endif
+      default: return kernels::advanceScalar;
+    }
+  }
+
+  inline AdvanceUniformFn advanceUniformKernel(Isa isa) {
+    if (!isaSupported(isa)) {
+      return nullptr;
+    }
+    switch (isa) {
+#ifdef MATAN_KERNELS_X86
+      case Isa::SSE2: return kernels::advanceUniformSSE2;
+      case Isa::AVX2: return kernels::advanceUniformAVX2;
+      case Isa::AVX512: return kernels::advanceUniformAVX512;
+#endif
+      default: return kernels::advanceUniformScalar;
+    }
+  }
+
+  inline AdvanceFixedFn advanceFixedKernel(Isa isa) {
+    if (!isaSupported(isa)) {
+      return nullptr;
+    }
+    switch (isa) {
+#ifdef MATAN_KERNELS_X86
+      case Isa::SSE2: return kernels::advanceFixedSSE2;
+      case Isa::AVX2: return kernels::advanceFixedAVX2;
+      case Isa::AVX512:
+        return __builtin_cpu_supports("avx512bw") ? kernels::advanceFixedAVX512 : nullptr;
+#endif
+      default: return kernels::advanceFixedScalar;
+    }
+  }
+
+  //pos[i] += vel[i] * dt for i in [0, n), with the widest kernel available.
+  inline void advance(float* pos, const float* vel, float dt, int n) {
+    static const AdvanceFn kernel = advanceKernel(bestIsa());
+    kernel(pos, vel, dt, n);
+  }
+
+  //pos[i] += step for i in [0, n), with the widest kernel available.
+  inline void advanceUniform(float* pos, float step, int n) {
+    static const AdvanceUniformFn kernel = advanceUniformKernel(bestIsa());
+    kernel(pos, step, n);
+  }
+
+  //pos[i] += step for i in [0, n), wrapping, with the widest kernel available.
+  inline void advanceFixed(std::int16_t* pos, std::int16_t step, int n) {
+    static const AdvanceFixedFn kernel = []() {
+      //AVX-512 without BW falls back to AVX2.
+      for (int isa = static_cast<int>(bestIsa()); isa > 0; --isa) {
+        if (AdvanceFixedFn fn = advanceFixedKernel(static_cast<Isa>(isa))) {
+          return fn;
+        }
+      }
+      return kernels::advanceFixedScalar;
+    }();
+    kernel(pos, step, n);
+  }
+} //namespace matan
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+#endif //MATAN_ENTITYKERNELS_HH
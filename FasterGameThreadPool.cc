@@ -236,13 +236,11 @@ void Game::update(Chunk& chunk,
 }
 
 void Game::updateChunks() {
-  for (int i = 0; i < CHUNKS_COUNT; i+=4) {
-    m_threadPool.enqueue(Game::update, m_chunks[i], playerLocation, m_chunkCounter++);
-    m_threadPool.enqueue(Game::update, m_chunks[i+1], playerLocation, m_chunkCounter++);
-    m_threadPool.enqueue(Game::update, m_chunks[i+2], playerLocation, m_chunkCounter++);
-    m_threadPool.enqueue(Game::update, m_chunks[i+3], playerLocation, m_chunkCounter++);
-  }
-  m_threadPool.waitFinished();
+  const int chunkCounter = m_chunkCounter;
+  m_threadPool.parallel_for(0, CHUNKS_COUNT, 1, [this, chunkCounter](int i) {
+    Game::update(m_chunks[i], playerLocation, chunkCounter + i);
+  });
+  m_chunkCounter += CHUNKS_COUNT;
 }
 
 int main(int argc, char* argv[]) {
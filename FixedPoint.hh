@@ -0,0 +1,256 @@
+/*
+ * Compact positions: a coordinate as a 16 bit offset from an anchor, in
+ * units of 1 / 2^FRACTION_BITS, so a column streams half the bytes a float
+ * column does.
+ *
+ * FixedFormat  - converting between floats and whole units.
+ * StepQuantizer - turns a float step into whole units per tick, carrying
+ *                 what rounding left over into the next tick. Positions stay
+ *                 within one unit of the exact sum however many ticks run,
+ *                 where quantizing the step once would be off by its rounding
+ *                 error every tick.
+ * FixedColumn  - a PagedArray of offsets with one anchor per column, moved
+ *                by uniform steps. Before a step could overflow an offset it
+ *                recenters the column, shifting the anchor by the same amount,
+ *                which is exact. Its span is limited; a value too far from the
+ *                rest coarsens the column instead, see push_back. shift()
+ *                moves every value by moving just the anchor instead.
+ *
+ * Floats go in and come out at the edges; updates never leave integers.
+ */
+
+#ifndef MATAN_FIXEDPOINT_HH
+#define MATAN_FIXEDPOINT_HH
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include "EntityKernels.hh"
+#include "SlotMap.hh"
+
+namespace matan {
+  template<int FRACTION_BITS>
+  struct FixedFormat {
+    static constexpr float SCALE = (float)(1 << FRACTION_BITS);
+    static constexpr float UNIT = 1.0f / SCALE;
+
+    //Nearest whole number of units to v.
+    static std::int64_t toUnits(float v) { return std::llrint((double)v * SCALE); };
+    static float toFloat(std::int64_t units) { return (float)((double)units * UNIT); };
+  };
+
+  class StepQuantizer {
+  public:
+    //Whole units to move this tick, for a step of units (fractional).
+    std::int64_t next(double units) {
+      m_residual += units;
+      const std::int64_t whole = std::llrint(m_residual);
+      m_residual -= whole;
+      return whole;
+    };
+    void reset() { m_residual = 0; };
+    //For units that are now 1 / factor as big.
+    void rescale(double factor) { m_residual *= factor; };
+
+  private:
+    double m_residual = 0;
+  };
+
+  template<int MAX_PAGES, int FRACTION_BITS = 5>
+  class FixedColumn {
+  public:
+    typedef FixedFormat<FRACTION_BITS> Format;
+    //Widest spread of values, in units, the column can hold.
+    static constexpr std::int32_t MAX_SPAN = 60000;
+    //Most times the column can halve its resolution, down to whole blocks.
+    static constexpr int MAX_COARSEN = FRACTION_BITS;
+    //Largest step one kernel pass takes; after recentering this never overflows.
+    static constexpr std::int32_t MAX_STEP = 32767 - MAX_SPAN / 2;
+
+    explicit FixedColumn(PagePool& pool) : m_offsets(pool) { resetBounds(); }
+    int size() const { return m_offsets.size(); };
+    //The raw offset, for moving values between slots of the column.
+    std::int16_t& operator[](int i) { return m_offsets[i]; };
+    std::int16_t operator[](int i) const { return m_offsets[i]; };
+    float get(int i) const { return toFloat(m_anchor + m_offsets[i]); };
+    //Where offsets count from. Only while empty.
+    void setAnchor(float origin) { m_anchor = toUnits(origin); };
+    /*
+     * If v is more than MAX_SPAN units from a value already in the column,
+     * the column first halves its resolution until it isn't, which rounds
+     * every value to the new unit. false, and nothing changes, if it would
+     * take more than MAX_COARSEN halvings in all; false too if there are no
+     * pages left, though the column stays coarsened.
+     */
+    bool push_back(float v);
+    void pop_back();
+    void clear();
+    //Same values as other, false if there weren't the pages for them.
+    bool copyFrom(const FixedColumn& other);
+    //Every value += step.
+    void advance(float step);
+    //The same, in O(1): only the anchor moves.
+    void shift(float step) { m_anchor += m_quantizer.next((double)step * scale()); };
+
+  private:
+    PagedArray<std::int16_t, MAX_PAGES> m_offsets;
+    std::int64_t m_anchor = 0;
+    //Bounds on the offsets. Removing values doesn't narrow them, recenter does.
+    std::int32_t m_low;
+    std::int32_t m_high;
+    StepQuantizer m_quantizer;
+    //A unit is 2^m_coarse of Format's, back to 1 when cleared.
+    int m_coarse = 0;
+
+    double scale() const { return (double)Format::SCALE / (1 << m_coarse); };
+    std::int64_t toUnits(float v) const { return std::llrint((double)v * scale()); };
+    float toFloat(std::int64_t units) const { return Format::toFloat(units * (1 << m_coarse)); };
+    //Spread of the values with units added, from the bounds.
+    std::int64_t spread(std::int64_t units) const {
+      return std::max<std::int64_t>(m_high, units) - std::min<std::int64_t>(m_low, units);
+    };
+    void resetBounds();
+    //Doubles the unit, rounding every value to it.
+    void coarsen();
+    //Shift every offset by -shift, and the anchor by +shift.
+    void recenter(std::int32_t shift);
+    void step(std::int16_t units);
+  };
+
+  template<int MAX_PAGES, int FRACTION_BITS>
+  void FixedColumn<MAX_PAGES, FRACTION_BITS>::resetBounds() {
+    m_low = std::numeric_limits<std::int32_t>::max();
+    m_high = std::numeric_limits<std::int32_t>::min();
+  }
+
+  template<int MAX_PAGES, int FRACTION_BITS>
+  bool FixedColumn<MAX_PAGES, FRACTION_BITS>::push_back(float v) {
+    std::int64_t units = toUnits(v) - m_anchor;
+    if (spread(units) > MAX_SPAN) {
+      //The bounds may be stale, recenter tightens them.
+      recenter(0);
+      if (spread(units) > MAX_SPAN) {
+        //Count first, so nothing changes if it can't fit. Each halving
+        //takes the spread to at most half plus one.
+        int halvings = 0;
+        for (std::int64_t wide = spread(units); wide > MAX_SPAN; wide = wide / 2 + 1) {
+          ++halvings;
+        }
+        if (m_coarse + halvings > MAX_COARSEN) {
+          return false;
+        }
+        while (spread(units = toUnits(v) - m_anchor) > MAX_SPAN) {
+          coarsen();
+        }
+      }
+    }
+    if (units < -32768 || units > 32767) {
+      //Center the column, v included, on the anchor.
+      const std::int32_t low = (std::int32_t)std::min<std::int64_t>(m_low, units);
+      const std::int32_t high = (std::int32_t)std::max<std::int64_t>(m_high, units);
+      const std::int32_t shift = low + (high - low) / 2;
+      recenter(shift);
+      units -= shift;
+    }
+    if (!m_offsets.push_back((std::int16_t)units)) {
+      return false;
+    }
+    m_low = std::min(m_low, (std::int32_t)units);
+    m_high = std::max(m_high, (std::int32_t)units);
+    return true;
+  }
+
+  template<int MAX_PAGES, int FRACTION_BITS>
+  void FixedColumn<MAX_PAGES, FRACTION_BITS>::pop_back() {
+    m_offsets.pop_back();
+    if (size() == 0) {
+      resetBounds();
+    }
+  }
+
+  template<int MAX_PAGES, int FRACTION_BITS>
+  void FixedColumn<MAX_PAGES, FRACTION_BITS>::clear() {
+    m_offsets.clear();
+    m_quantizer.reset();
+    m_coarse = 0;
+    resetBounds();
+  }
+
+  template<int MAX_PAGES, int FRACTION_BITS>
+  bool FixedColumn<MAX_PAGES, FRACTION_BITS>::copyFrom(const FixedColumn& other) {
+    if (!m_offsets.copyFrom(other.m_offsets)) {
+      return false;
+    }
+    m_anchor = other.m_anchor;
+    m_low = other.m_low;
+    m_high = other.m_high;
+    m_quantizer = other.m_quantizer;
+    m_coarse = other.m_coarse;
+    return true;
+  }
+
+  template<int MAX_PAGES, int FRACTION_BITS>
+  void FixedColumn<MAX_PAGES, FRACTION_BITS>::coarsen() {
+    //Center the offsets on an even anchor, then (anchor + offset) / 2 rounds
+    //to anchor / 2 + (offset + 1) / 2, halves rounding up.
+    std::int32_t shift = m_low + (m_high - m_low) / 2;
+    if ((m_anchor + shift) & 1) {
+      ++shift;
+    }
+    recenter(shift);
+    resetBounds();
+    for (int p = 0; p < m_offsets.pageCount(); ++p) {
+      std::int16_t* page = m_offsets.page(p);
+      for (int i = 0; i < m_offsets.pageSize(p); ++i) {
+        page[i] = (std::int16_t)((page[i] + 1) >> 1);
+        m_low = std::min(m_low, (std::int32_t)page[i]);
+        m_high = std::max(m_high, (std::int32_t)page[i]);
+      }
+    }
+    m_anchor /= 2;
+    m_quantizer.rescale(0.5);
+    ++m_coarse;
+  }
+
+  template<int MAX_PAGES, int FRACTION_BITS>
+  void FixedColumn<MAX_PAGES, FRACTION_BITS>::recenter(std::int32_t shift) {
+    resetBounds();
+    for (int p = 0; p < m_offsets.pageCount(); ++p) {
+      std::int16_t* page = m_offsets.page(p);
+      for (int i = 0; i < m_offsets.pageSize(p); ++i) {
+        page[i] = (std::int16_t)(page[i] - shift);
+        m_low = std::min(m_low, (std::int32_t)page[i]);
+        m_high = std::max(m_high, (std::int32_t)page[i]);
+      }
+    }
+    m_anchor += shift;
+  }
+
+  template<int MAX_PAGES, int FRACTION_BITS>
+  void FixedColumn<MAX_PAGES, FRACTION_BITS>::step(std::int16_t units) {
+    if (m_high + units > 32767 || m_low + units < -32768) {
+      recenter(m_low + (m_high - m_low) / 2);
+    }
+    for (int p = 0; p < m_offsets.pageCount(); ++p) {
+      advanceFixed(m_offsets.page(p), units, m_offsets.pageSize(p));
+    }
+    m_low += units;
+    m_high += units;
+  }
+
+  template<int MAX_PAGES, int FRACTION_BITS>
+  void FixedColumn<MAX_PAGES, FRACTION_BITS>::advance(float step) {
+    std::int64_t units = m_quantizer.next((double)step * scale());
+    if (size() == 0) {
+      return;
+    }
+    while (units != 0) {
+      const std::int64_t part = std::clamp<std::int64_t>(units, -MAX_STEP, MAX_STEP);
+      this->step((std::int16_t)part);
+      units -= part;
+    }
+  }
+} //namespace matan
+
+#endif //MATAN_FIXEDPOINT_HH
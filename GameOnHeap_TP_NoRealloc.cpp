@@ -16,7 +16,21 @@
 #include <cmath>
 #include <string>
 #include <array>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
 #include "ThreadPool.hh"
+#include "TaskGraph.hh"
+#include "Coroutine.hh"
+#include "Topology.hh"
+#include "EntityKernels.hh"
+#include "SpatialGrid.hh"
+#include "SlotMap.hh"
+#include "FixedPoint.hh"
+#include "SectionStorage.hh"
+#include "Terrain.hh"
+#include "ChunkCache.hh"
 #include "memory.hh"
 
 using namespace std;
@@ -77,77 +91,707 @@ public:
 class Entity {
 public:
   enum class Type { Zombie,Chicken,Exploder,TallCreepyThing };
+  static constexpr int TYPE_COUNT = 4;
 
   Vector m_location;
   Vector speed;
   const char* name;
   int health;
+  Type type;
 
   Entity(Vector, Type);
   Entity() = default;
   ~Entity() = default;
-  void updatePosition();
   static const char* get_name(Type type);
 };
 
+/*
+ * What every entity of a type has in common, as compile time constants.
+ * Archetype<T> builds its update from these, so a zero speed on an axis
+ * means that axis is never touched.
+ */
+template<Entity::Type T> struct EntityTraits;
+
+template<> struct EntityTraits<Entity::Type::Zombie> {
+  static constexpr const char* NAME = "Zombie";
+  static constexpr int HEALTH = 50;
+  static constexpr float SPEED[3] = {0.5f, 0.0f, 0.5f};
+};
+
+template<> struct EntityTraits<Entity::Type::Chicken> {
+  static constexpr const char* NAME = "Chicken";
+  static constexpr int HEALTH = 25;
+  static constexpr float SPEED[3] = {0.75f, 0.25f, 0.75f};
+};
+
+template<> struct EntityTraits<Entity::Type::Exploder> {
+  static constexpr const char* NAME = "Exploder";
+  static constexpr int HEALTH = 75;
+  static constexpr float SPEED[3] = {0.75f, 0.0f, 0.75f};
+};
+
+template<> struct EntityTraits<Entity::Type::TallCreepyThing> {
+  static constexpr const char* NAME = "Tall Creepy Thing";
+  static constexpr int HEALTH = 500;
+  static constexpr float SPEED[3] = {1.0f, 1.0f, 1.0f};
+};
+
+template<Entity::Type T>
+Entity makeEntity(Vector location) {
+  typedef EntityTraits<T> Traits;
+  Entity entity;
+  entity.m_location = location;
+  entity.speed = Vector(Traits::SPEED[0], Traits::SPEED[1], Traits::SPEED[2]);
+  entity.name = Traits::NAME;
+  entity.health = Traits::HEALTH;
+  entity.type = T;
+  return entity;
+}
+
 const char* Entity::get_name(Type type) {
   switch(type)
   {
     case Type::Zombie:
-      return "Zombie";
+      return EntityTraits<Type::Zombie>::NAME;
     case Type::Chicken:
-      return"Chicken";
+      return EntityTraits<Type::Chicken>::NAME;
     case Type::Exploder:
-      return "Exploder";
+      return EntityTraits<Type::Exploder>::NAME;
     case Type::TallCreepyThing:
-      return "Tall Creepy Thing";
+      return EntityTraits<Type::TallCreepyThing>::NAME;
   }
+  return nullptr;
 }
 
-Entity::Entity (Vector location,Type type) :
-    m_location(location),
-    name(Entity::get_name(type)) {
+Entity::Entity (Vector location,Type type) {
   switch(type)
   {
     case Type::Zombie:
-      health = 50;
-      speed = Vector(0.5,0.0,0.5);
+      *this = makeEntity<Type::Zombie>(location);
       break;
     case Type::Chicken:
-      health = 25;
-      speed = Vector(0.75,0.25,0.75);
+      *this = makeEntity<Type::Chicken>(location);
       break;
     case Type::Exploder:
-      health = 75;
-      speed = Vector(0.75,0.0,0.75);
+      *this = makeEntity<Type::Exploder>(location);
       break;
     case Type::TallCreepyThing:
-      health = 500;
-      speed = Vector(1.0,1.0,1.0);
+      *this = makeEntity<Type::TallCreepyThing>(location);
+      break;
+  }
+}
+
+/*
+ * Build with -DMATAN_COMPACT_POSITIONS to keep entity positions as 16 bit
+ * fixed point offsets from the chunk's corner (FixedColumn) instead of world
+ * space floats. The update streams half the bytes; in exchange positions
+ * snap to 1/32 of a block. A migrant more than about 1800 blocks on any
+ * axis from the rest of its type in its new chunk halves that column's
+ * resolution, as many times as it takes, down to whole blocks at 60000.
+ */
+#ifdef MATAN_COMPACT_POSITIONS
+constexpr bool COMPACT_POSITIONS = true;
+#else
+constexpr bool COMPACT_POSITIONS = false;
+#endif
+
+/*
+ * Build with -DMATAN_LAZY_POSITIONS to stop writing positions every tick.
+ * Every entity of a type moves at the same constant speed, so an archetype
+ * only counts how far its type has moved and position() adds that to what
+ * the columns hold. Compact columns move their anchor instead. Float
+ * columns are written out once the distance passes REBASE_DISTANCE, to keep
+ * the sum precise. Either way the update is O(1) per archetype.
+ */
+#ifdef MATAN_LAZY_POSITIONS
+constexpr bool LAZY_POSITIONS = true;
+#else
+constexpr bool LAZY_POSITIONS = false;
+#endif
+
+/*
+ * Build with -DMATAN_CHUNK_CACHE to keep generated blocks in Chunk::cache()
+ * for chunks that come back to a coordinate they had not long ago. Off by
+ * default: Game regenerates chunks at ever new coordinates (chunkCounter),
+ * so the cache would never hit, while every insert keeps a chunk's sections
+ * resident and shared, which stops regeneration reusing them in place.
+ */
+#ifdef MATAN_CHUNK_CACHE
+constexpr bool CHUNK_CACHE = true;
+#else
+constexpr bool CHUNK_CACHE = false;
+#endif
+
+/*
+ * All the entities of one type in a chunk, as columns. Position is the hot
+ * data, one column per axis; health is the only thing that differs per
+ * entity otherwise and sits in a cold column of its own. Speed, name and
+ * starting health come from EntityTraits<T> and aren't stored at all.
+ *
+ * The columns are PagedArrays, so an archetype holds as many entities as
+ * the page pool lets it and none of them ever move in memory as it grows.
+ * slot is each entity's slot in its EntityStore's SlotTable.
+ */
+template<Entity::Type T>
+class Archetype {
+public:
+  typedef EntityTraits<T> Traits;
+  static constexpr Entity::Type TYPE = T;
+  static constexpr int MAX_PAGES = 64;
+  //Blocks lazy float columns move before they're written out.
+  static constexpr double REBASE_DISTANCE = 1024;
+  template<class V> using Column = matan::PagedArray<V, MAX_PAGES>;
+  typedef std::conditional_t<COMPACT_POSITIONS, matan::FixedColumn<MAX_PAGES>,
+                             Column<float>> PositionColumn;
+
+  explicit Archetype(matan::PagePool& pool) :
+      m_x(pool), m_y(pool), m_z(pool), m_health(pool), m_slot(pool) {}
+  int size() const { return m_x.size(); };
+  //Where compact positions count from. Only while empty.
+  void setOrigin(Vector origin);
+  //Returns the new entity's index, or -1 if there was no room.
+  int add(Vector location, int health, std::uint32_t slot);
+  Entity get(int i) const;
+  Vector position(int i) const;
+  std::uint32_t slot(int i) const { return m_slot[i]; };
+  //The last entity takes i's place. Returns its slot, now pointing at i.
+  std::uint32_t remove(int i);
+  void clear();
+  /*
+   * The same entities as other, moved by offset. false, leaving it empty,
+   * if there weren't the pages for them.
+   */
+  bool copyFrom(const Archetype& other, Vector offset);
+  //Moves every entity by its type's speed times dt.
+  void update(float dt);
+  /*
+   * With lazy positions, true if no entity can be outside [low, high) on x,
+   * from bounds kept as entities are added. Always false otherwise. A scan
+   * that finds the real bounds passes them on with resetBoundsX and
+   * includeX.
+   */
+  bool insideX(float low, float high) const;
+  void resetBoundsX();
+  void includeX(float x);
+
+private:
+  //Slack for rounding between a position and the bounds on it.
+  static constexpr double BOUNDS_SLACK = 1.0 / 16;
+
+  PositionColumn m_x;
+  PositionColumn m_y;
+  PositionColumn m_z;
+  Column<int> m_health;
+  Column<std::uint32_t> m_slot;
+  //Lazy float columns: how far each axis has moved since they were written.
+  double m_moved[3] = {0, 0, 0};
+  //Lazy: how far x has moved in all, and bounds on x less that.
+  double m_travelledX = 0;
+  double m_lowX = std::numeric_limits<double>::max();
+  double m_highX = std::numeric_limits<double>::lowest();
+
+  //Templates on the column so only the branch for PositionColumn compiles.
+  template<class C> static void anchor(C& column, float origin);
+  template<class C> static float coordinate(const C& column, int i);
+  //Every value in column += delta.
+  template<class C> static void translate(C& column, float delta);
+  template<int AXIS, class C> void updateAxis(C& column, float dt);
+  //The lazy offset position() adds to column AXIS.
+  float moved(int axis) const { return (float)m_moved[axis]; };
+};
+
+template<Entity::Type T>
+template<class C>
+void Archetype<T>::anchor(C& column, float origin) {
+  if constexpr (COMPACT_POSITIONS) {
+    column.setAnchor(origin);
+  }
+}
+
+template<Entity::Type T>
+template<class C>
+float Archetype<T>::coordinate(const C& column, int i) {
+  if constexpr (COMPACT_POSITIONS) {
+    return column.get(i);
+  } else {
+    return column[i];
+  }
+}
+
+template<Entity::Type T>
+template<class C>
+void Archetype<T>::translate(C& column, float delta) {
+  if constexpr (COMPACT_POSITIONS) {
+    column.shift(delta);
+  } else {
+    for (int p = 0; p < column.pageCount(); ++p) {
+      matan::advanceUniform(column.page(p), delta, column.pageSize(p));
+    }
+  }
+}
+
+template<Entity::Type T>
+void Archetype<T>::setOrigin(Vector origin) {
+  anchor(m_x, origin.x);
+  anchor(m_y, origin.y);
+  anchor(m_z, origin.z);
+}
+
+template<Entity::Type T>
+Vector Archetype<T>::position(int i) const {
+  if constexpr (LAZY_POSITIONS && !COMPACT_POSITIONS) {
+    return Vector(coordinate(m_x, i) + moved(0), coordinate(m_y, i) + moved(1),
+                  coordinate(m_z, i) + moved(2));
+  } else {
+    return Vector(coordinate(m_x, i), coordinate(m_y, i), coordinate(m_z, i));
+  }
+}
+
+template<Entity::Type T>
+int Archetype<T>::add(Vector location, int health, std::uint32_t slot) {
+  if constexpr (LAZY_POSITIONS && !COMPACT_POSITIONS) {
+    location = Vector(location.x - moved(0), location.y - moved(1), location.z - moved(2));
+  }
+  //All or nothing, a column can't come up short.
+  const int i = size();
+  if (!m_x.push_back(location.x)) {
+    return -1;
+  }
+  if (!m_y.push_back(location.y)) {
+    m_x.pop_back();
+    return -1;
+  }
+  if (!m_z.push_back(location.z)) {
+    m_x.pop_back();
+    m_y.pop_back();
+    return -1;
+  }
+  if (!m_health.push_back(health)) {
+    m_x.pop_back();
+    m_y.pop_back();
+    m_z.pop_back();
+    return -1;
+  }
+  if (!m_slot.push_back(slot)) {
+    m_x.pop_back();
+    m_y.pop_back();
+    m_z.pop_back();
+    m_health.pop_back();
+    return -1;
+  }
+  if constexpr (LAZY_POSITIONS) {
+    includeX(position(i).x);
+  }
+  return i;
+}
+
+template<Entity::Type T>
+Entity Archetype<T>::get(int i) const {
+  Entity entity = makeEntity<T>(position(i));
+  entity.health = m_health[i];
+  return entity;
+}
+
+template<Entity::Type T>
+std::uint32_t Archetype<T>::remove(int i) {
+  const int last = size() - 1;
+  const std::uint32_t moved = m_slot[last];
+  m_x[i] = m_x[last];
+  m_y[i] = m_y[last];
+  m_z[i] = m_z[last];
+  m_health[i] = m_health[last];
+  m_slot[i] = m_slot[last];
+  m_x.pop_back();
+  m_y.pop_back();
+  m_z.pop_back();
+  m_health.pop_back();
+  m_slot.pop_back();
+  return moved;
+}
+
+template<Entity::Type T>
+void Archetype<T>::clear() {
+  m_x.clear();
+  m_y.clear();
+  m_z.clear();
+  m_health.clear();
+  m_slot.clear();
+  m_moved[0] = m_moved[1] = m_moved[2] = 0;
+  resetBoundsX();
+}
+
+template<Entity::Type T>
+bool Archetype<T>::copyFrom(const Archetype& other, Vector offset) {
+  if (!m_x.copyFrom(other.m_x) || !m_y.copyFrom(other.m_y) || !m_z.copyFrom(other.m_z) ||
+      !m_health.copyFrom(other.m_health) || !m_slot.copyFrom(other.m_slot)) {
+    clear();
+    return false;
+  }
+  std::copy(other.m_moved, other.m_moved + 3, m_moved);
+  m_travelledX = other.m_travelledX;
+  m_lowX = other.m_lowX + offset.x;
+  m_highX = other.m_highX + offset.x;
+  translate(m_x, offset.x);
+  translate(m_y, offset.y);
+  translate(m_z, offset.z);
+  return true;
+}
+
+template<Entity::Type T>
+void Archetype<T>::update(float dt) {
+  updateAxis<0>(m_x, dt);
+  updateAxis<1>(m_y, dt);
+  updateAxis<2>(m_z, dt);
+  if constexpr (LAZY_POSITIONS) {
+    m_travelledX += Traits::SPEED[0] * dt;
+  }
+}
+
+template<Entity::Type T>
+bool Archetype<T>::insideX(float low, float high) const {
+  return LAZY_POSITIONS &&
+         m_lowX + m_travelledX >= low + BOUNDS_SLACK &&
+         m_highX + m_travelledX < high - BOUNDS_SLACK;
+}
+
+template<Entity::Type T>
+void Archetype<T>::resetBoundsX() {
+  if constexpr (!LAZY_POSITIONS) {
+    return;
+  }
+  m_lowX = std::numeric_limits<double>::max();
+  m_highX = std::numeric_limits<double>::lowest();
+}
+
+template<Entity::Type T>
+void Archetype<T>::includeX(float x) {
+  if constexpr (!LAZY_POSITIONS) {
+    return;
+  }
+  m_lowX = std::min(m_lowX, x - m_travelledX);
+  m_highX = std::max(m_highX, x - m_travelledX);
+}
+
+template<Entity::Type T>
+template<int AXIS, class C>
+void Archetype<T>::updateAxis(C& column, float dt) {
+  const float step = Traits::SPEED[AXIS] * dt;
+  if constexpr (Traits::SPEED[AXIS] == 0.0f) {
+    return;
+  } else if constexpr (LAZY_POSITIONS && COMPACT_POSITIONS) {
+    column.shift(step);
+  } else if constexpr (LAZY_POSITIONS) {
+    m_moved[AXIS] += step;
+    if (std::fabs(m_moved[AXIS]) > REBASE_DISTANCE) {
+      //Same float add position() does, so no entity jumps.
+      for (int p = 0; p < column.pageCount(); ++p) {
+        matan::advanceUniform(column.page(p), moved(AXIS), column.pageSize(p));
+      }
+      m_moved[AXIS] = 0;
+    }
+  } else if constexpr (COMPACT_POSITIONS) {
+    column.advance(step);
+  } else {
+    for (int p = 0; p < column.pageCount(); ++p) {
+      matan::advanceUniform(column.page(p), step, column.pageSize(p));
+    }
+  }
+}
+
+/*
+ * A chunk's entities, one Archetype per type, any number of each. Counting
+ * the entities of a type is reading one int, and the update runs each
+ * type's own kernel.
+ *
+ * Spawning an entity returns a Handle that stays valid while it lives here,
+ * however the archetypes shuffle. Once it's removed, or migrates to another
+ * chunk, the handle fails contains() and remove(). Handles only mean
+ * something to the store that made them.
+ */
+class EntityStore {
+public:
+  typedef matan::SlotHandle Handle;
+  //Per chunk, bounded by the slot table and the grid, not by any array.
+  static constexpr int CAPACITY = 65536;
+
+  Archetype<Entity::Type::Zombie> zombies;
+  Archetype<Entity::Type::Chicken> chickens;
+  Archetype<Entity::Type::Exploder> exploders;
+  Archetype<Entity::Type::TallCreepyThing> tallCreepyThings;
+
+  explicit EntityStore(matan::PagePool& pool);
+  //See Archetype::setOrigin.
+  void setOrigin(Vector origin);
+  int size() const { return m_slots.size(); };
+  int count(Entity::Type type) const;
+  //false if the page pool ran dry, or the chunk is at CAPACITY.
+  bool add(const Entity& entity, Handle* handle = nullptr);
+  bool remove(Handle handle);
+  bool contains(Handle handle) const { return m_slots.contains(handle); };
+  //The entity handle refers to, which must be live.
+  Entity get(Handle handle) const;
+  //Live handle of the entity in slot, see Archetype::slot.
+  Handle handle(std::uint32_t slot) const { return m_slots.handle(slot); };
+  //Remove entity i of archetype, for loops that walk the archetypes.
+  template<class A> void removeAt(A& archetype, int i);
+  //Archetype::includeX for the entity handle refers to, which must be live.
+  void includeX(Handle handle);
+  void clear();
+  /*
+   * The same entities as other, moved by offset, in the same slots. Handles
+   * into other don't work here. false, leaving it empty, if there weren't
+   * the pages for them.
+   */
+  bool copyFrom(const EntityStore& other, Vector offset);
+  void update(float dt);
+  //f(archetype) for each archetype, with its concrete type.
+  template<class F> void forEachArchetype(F&& f);
+
+private:
+  //Slot values say where the entity is: type in the top byte, index below.
+  matan::SlotTable<CAPACITY / 512> m_slots;
+
+  static std::uint32_t location(Entity::Type type, int i) {
+    return (std::uint32_t)type << 24 | i;
+  };
+};
+
+EntityStore::EntityStore(matan::PagePool& pool) :
+    zombies(pool), chickens(pool), exploders(pool), tallCreepyThings(pool),
+    m_slots(pool) {}
+
+void EntityStore::setOrigin(Vector origin) {
+  forEachArchetype([origin](auto& archetype) { archetype.setOrigin(origin); });
+}
+
+int EntityStore::count(Entity::Type type) const {
+  switch (type) {
+    case Entity::Type::Zombie: return zombies.size();
+    case Entity::Type::Chicken: return chickens.size();
+    case Entity::Type::Exploder: return exploders.size();
+    case Entity::Type::TallCreepyThing: return tallCreepyThings.size();
+  }
+  return 0;
+}
+
+bool EntityStore::add(const Entity& entity, Handle* handle) {
+  if (size() >= CAPACITY) {
+    return false;
+  }
+  Handle h;
+  if (!m_slots.insert(0, h)) {
+    return false;
+  }
+  int i = -1;
+  switch (entity.type) {
+    case Entity::Type::Zombie:
+      i = zombies.add(entity.m_location, entity.health, h.slot);
+      break;
+    case Entity::Type::Chicken:
+      i = chickens.add(entity.m_location, entity.health, h.slot);
+      break;
+    case Entity::Type::Exploder:
+      i = exploders.add(entity.m_location, entity.health, h.slot);
+      break;
+    case Entity::Type::TallCreepyThing:
+      i = tallCreepyThings.add(entity.m_location, entity.health, h.slot);
+      break;
+  }
+  if (i < 0) {
+    m_slots.erase(h);
+    return false;
+  }
+  m_slots.value(h.slot) = location(entity.type, i);
+  if (handle) {
+    *handle = h;
+  }
+  return true;
+}
+
+Entity EntityStore::get(Handle handle) const {
+  const std::uint32_t where = m_slots.value(handle.slot);
+  const int i = where & 0xffffff;
+  switch (static_cast<Entity::Type>(where >> 24)) {
+    case Entity::Type::Zombie: return zombies.get(i);
+    case Entity::Type::Chicken: return chickens.get(i);
+    case Entity::Type::Exploder: return exploders.get(i);
+    case Entity::Type::TallCreepyThing: return tallCreepyThings.get(i);
+  }
+  return Entity();
+}
+
+bool EntityStore::remove(Handle handle) {
+  if (!contains(handle)) {
+    return false;
+  }
+  const std::uint32_t where = m_slots.value(handle.slot);
+  const int i = where & 0xffffff;
+  switch (static_cast<Entity::Type>(where >> 24)) {
+    case Entity::Type::Zombie: removeAt(zombies, i); break;
+    case Entity::Type::Chicken: removeAt(chickens, i); break;
+    case Entity::Type::Exploder: removeAt(exploders, i); break;
+    case Entity::Type::TallCreepyThing: removeAt(tallCreepyThings, i); break;
+  }
+  return true;
+}
+
+void EntityStore::includeX(Handle handle) {
+  const std::uint32_t where = m_slots.value(handle.slot);
+  const int i = where & 0xffffff;
+  switch (static_cast<Entity::Type>(where >> 24)) {
+    case Entity::Type::Zombie: zombies.includeX(zombies.position(i).x); break;
+    case Entity::Type::Chicken: chickens.includeX(chickens.position(i).x); break;
+    case Entity::Type::Exploder: exploders.includeX(exploders.position(i).x); break;
+    case Entity::Type::TallCreepyThing:
+      tallCreepyThings.includeX(tallCreepyThings.position(i).x);
       break;
   }
 }
 
-void Entity::updatePosition() {
-  m_location.x = m_location.x + 1.0f * speed.x;
-  m_location.y = m_location.y + 1.0f * speed.y;
-  m_location.z = m_location.z + 1.0f * speed.z;
+template<class A>
+void EntityStore::removeAt(A& archetype, int i) {
+  m_slots.erase(handle(archetype.slot(i)));
+  const bool last = i == archetype.size() - 1;
+  const std::uint32_t moved = archetype.remove(i);
+  if (!last) {
+    m_slots.value(moved) = location(A::TYPE, i);
+  }
+}
+
+void EntityStore::clear() {
+  forEachArchetype([](auto& archetype) { archetype.clear(); });
+  m_slots.clear();
 }
 
+bool EntityStore::copyFrom(const EntityStore& other, Vector offset) {
+  if (!zombies.copyFrom(other.zombies, offset) ||
+      !chickens.copyFrom(other.chickens, offset) ||
+      !exploders.copyFrom(other.exploders, offset) ||
+      !tallCreepyThings.copyFrom(other.tallCreepyThings, offset) ||
+      !m_slots.copyFrom(other.m_slots)) {
+    clear();
+    return false;
+  }
+  return true;
+}
+
+void EntityStore::update(float dt) {
+  forEachArchetype([dt](auto& archetype) { archetype.update(dt); });
+}
+
+template<class F>
+void EntityStore::forEachArchetype(F&& f) {
+  f(zombies);
+  f(chickens);
+  f(exploders);
+  f(tallCreepyThings);
+}
+
+/*
+ * Chunks sit in a row along x. location.x is the chunk's coordinate k and it
+ * owns the entities with k * WIDTH <= x < (k + 1) * WIDTH.
+ */
 class Chunk {
 public:
-  std::array<unsigned char, 65536> blocks;
-  std::array<Entity, 1000> entities;
+  //How many entities a new chunk starts with, a quarter of each type.
+  static constexpr int ENTITY_COUNT = 1000;
+  static constexpr float WIDTH = 16.0f;
+  static constexpr float GRID_CELL = 4.0f;
+  static constexpr int BLOCK_COUNT = 65536;
+  //16x16x16, see SectionStorage.
+  static constexpr int SECTION_BLOCKS = 4096;
+  //Pages shared by every chunk's blocks, entities and grid. 64MB reserved,
+  //only pages that have been handed out are resident.
+  static constexpr int POOL_PAGES = 16384;
+  static constexpr std::uint32_t WORLD_SEED = 20160901;
+  //Generated blocks kept for chunks that come back into range, from the
+  //same pool. About 5KB a chunk, so many times the loaded world's worth.
+  static constexpr std::size_t CACHE_BYTES = 8 << 20;
+  typedef matan::SpatialGrid<1024, matan::PagedArray<matan::GridEntry, 256>> Grid;
+  typedef matan::SectionStorage<BLOCK_COUNT / SECTION_BLOCKS, SECTION_BLOCKS> Blocks;
+  typedef matan::ChunkCache<Blocks> Cache;
+  //Block ids, by section, uniform sections elided and the rest palette
+  //compressed.
+  Blocks blocks{pagePool()};
+  EntityStore entities{pagePool()};
+  //Where the entities were after the last tick, for proximity queries.
+  //Entry ids are slots, see entity().
+  Grid grid{GRID_CELL, pagePool()};
   Vector location;
 
   Chunk(Vector);
   Chunk(float x, float y, float z);
   Chunk() = default;
   ~Chunk() = default;
+  //Terrain generated for location, entities a copy of prototype()'s.
   void init();
-  void processEntities();
+  /*
+   * reset(loc), giving the worker back to pool's frame work after each
+   * section of terrain it generates.
+   */
+  matan::Job<> generate(matan::ThreadPool& pool, Vector loc);
+  /*
+   * The same as a Chunk() or Chunk(loc) in its place, but keeping what
+   * pages it can and rewriting only what a new one would have differently.
+   * For SlabPool.
+   */
+  void reset();
+  void reset(Vector loc);
+  //Moves the entities dt ticks' worth.
+  void processEntities(float dt);
+  int coordinate() const { return (int)location.x; };
+  static int coordinateOf(float x) { return (int)std::floor(x / WIDTH); };
+  /*
+   * Offers each entity that has moved out of this chunk to
+   * leave(entity, handle, coordinate of its new chunk). Nothing is removed:
+   * the ones leave returns true for are on their way, and whoever moves them
+   * removes each once it's in its new chunk, or passes it to
+   * EntityStore::includeX if it couldn't get in. The others stay for now.
+   */
+  template<class F> void emigrate(F&& leave);
+  //Rebuild grid from the entities' current positions.
+  void indexEntities();
+  Entity entity(std::uint32_t id) const {
+    return entities.get(entities.handle(id));
+  };
+  //Where block, entity and grid pages come from.
+  static matan::PagePool& pagePool();
+  //Terrain of WORLD_SEED, on the best kernel this CPU has.
+  static const matan::Terrain& terrain();
+  //Blocks by (coordinate, WORLD_SEED), CACHE_BYTES of them to start with.
+  //Only used with CHUNK_CACHE.
+  static Cache& cache();
+  /*
+   * Every chunk starts out with the same entities but for where they are,
+   * so one is built at location 0, the first time it's asked for, and
+   * init() copies them.
+   */
+  static const Chunk& prototype();
+
+private:
+  struct FromScratch {};
+  //Places the entities rather than copying them.
+  Chunk(Vector loc, FromScratch);
+  void generateBlocks();
+  //Blocks from cache(), false if it doesn't have them or there's no cache.
+  bool findBlocks();
+  //Section s of the terrain whose heightmap is heights, false if the
+  //blocks couldn't get the memory for it.
+  bool generateSection(const int* heights, int s);
+  void copyEntities();
+  void placeEntities(int count = ENTITY_COUNT);
 };
 
+static_assert(Chunk::WIDTH == matan::Terrain::WIDTH &&
+              Chunk::BLOCK_COUNT == matan::Terrain::BLOCKS &&
+              Chunk::SECTION_BLOCKS == matan::Terrain::SECTION_BLOCKS,
+              "Chunk blocks are laid out as Terrain generates them");
+
+matan::PagePool& Chunk::pagePool() {
+  static matan::PagePool pool(POOL_PAGES);
+  return pool;
+}
+
 Chunk::Chunk(Vector loc) :
   location(loc) {
   init();
@@ -158,50 +802,306 @@ Chunk::Chunk(float x, float y, float z) :
   init();
 }
 
+const matan::Terrain& Chunk::terrain() {
+  static const matan::Terrain terrain(WORLD_SEED);
+  return terrain;
+}
+
+Chunk::Cache& Chunk::cache() {
+  static Cache cache(CACHE_BYTES);
+  return cache;
+}
+
+const Chunk& Chunk::prototype() {
+  static const Chunk chunk(Vector(0, 0, 0), FromScratch{});
+  return chunk;
+}
+
+Chunk::Chunk(Vector loc, FromScratch) :
+  location(loc) {
+  placeEntities();
+}
+
 void Chunk::init() {
-  for (int i = 0; i < blocks.size(); i+=4) {
-    blocks[i] = i%256;
-    blocks[i+1] = (i+1)%256;
-    blocks[i+2] = (i+2)%256;
-    blocks[i+3] = (i+3)%256;
+  generateBlocks();
+  copyEntities();
+}
+
+matan::Job<> Chunk::generate(matan::ThreadPool& pool, Vector loc) {
+  location = loc;
+  if (!findBlocks()) {
+    std::array<int, matan::Terrain::COLUMNS> heights;
+    terrain().heightmap(coordinate(), heights.data());
+    bool complete = true;
+    for (int s = 0; s < BLOCK_COUNT / SECTION_BLOCKS; ++s) {
+      complete = generateSection(heights.data(), s) && complete;
+      co_await matan::resumeOn(pool, matan::ThreadPool::Priority::Background);
+    }
+    if (CHUNK_CACHE && complete) {
+      cache().insert({coordinate(), terrain().seed()}, blocks, blocks.storedBytes());
+    }
   }
+  copyEntities();
+}
 
-  for (int i = 0; i < entities.size(); i+=4) {
-    matan::place(&entities[i], Vector(i,i,i), Entity::Type::Zombie);
-    matan::place(&entities[i+1], Vector(i+1,i+1,i+1), Entity::Type::Chicken);
-    matan::place(&entities[i+2], Vector(i+2,i+2,i+2), Entity::Type::Exploder);
-    matan::place(&entities[i+3], Vector(i+3,i+3,i+3), Entity::Type::TallCreepyThing);
+/*
+ * Entities are a memcpy of the prototype's columns, then one kernel pass to
+ * move them over; they move every tick, copy on write would copy them
+ * straight away.
+ */
+void Chunk::copyEntities() {
+  const Chunk& from = prototype();
+  if (!entities.copyFrom(from.entities, Vector((location.x - from.location.x) * WIDTH, 0, 0))) {
+    //Out of pages, it starts out empty.
+    entities.setOrigin(Vector(location.x * WIDTH, location.y, location.z));
   }
+  indexEntities();
 }
 
-void Chunk::processEntities() {
-  for (int i = 0; i < entities.size(); i+=4) {
-    entities[i].updatePosition();
-    entities[i+1].updatePosition();
-    entities[i+2].updatePosition();
-    entities[i+3].updatePosition();
+void Chunk::reset() {
+  blocks.fill(0);
+  entities.clear();
+  indexEntities();
+}
+
+void Chunk::reset(Vector loc) {
+  location = loc;
+  init();
+}
+
+/*
+ * A section at a time, so only one section's ids are ever unpacked. Air
+ * above the ground and stone under it come out uniform and are elided,
+ * the rest reuse what sections this chunk already had to itself. A section
+ * the pool had no room for leaves the blocks wrong, so they aren't cached.
+ *
+ * With CHUNK_CACHE, blocks are shared with the cache rather than copied,
+ * and whichever side writes a section first copies it. The cache's size
+ * for them counts every section, as it keeps them all after the chunk is
+ * gone.
+ */
+void Chunk::generateBlocks() {
+  if (findBlocks()) {
+    return;
+  }
+  std::array<int, matan::Terrain::COLUMNS> heights;
+  terrain().heightmap(coordinate(), heights.data());
+  bool complete = true;
+  for (int s = 0; s < BLOCK_COUNT / SECTION_BLOCKS; ++s) {
+    complete = generateSection(heights.data(), s) && complete;
+  }
+  if (CHUNK_CACHE && complete) {
+    cache().insert({coordinate(), terrain().seed()}, blocks, blocks.storedBytes());
+  }
+}
+
+bool Chunk::findBlocks() {
+  if (!CHUNK_CACHE) {
+    return false;
+  }
+  const matan::ChunkKey key{coordinate(), terrain().seed()};
+  return cache().find(key, [this](const Blocks& cached) { blocks.copyFrom(cached); });
+}
+
+bool Chunk::generateSection(const int* heights, int s) {
+  std::array<unsigned char, SECTION_BLOCKS> ids;
+  terrain().section(coordinate(), heights, s, ids.data());
+  return blocks.encode(s * SECTION_BLOCKS, SECTION_BLOCKS, ids.data());
+}
+
+void Chunk::placeEntities(int count) {
+  //Spread over the chunk's width, so they start out inside it.
+  const float x = location.x * WIDTH;
+  const int w = (int)WIDTH;
+  entities.clear();
+  entities.setOrigin(Vector(x, location.y, location.z));
+  for (int i = 0; i < count; ++i) {
+    const auto type = static_cast<Entity::Type>(i % Entity::TYPE_COUNT);
+    if (!entities.add(Entity(Vector(x+i%w,i,i), type))) {
+      break;
+    }
   }
+  indexEntities();
+}
+
+void Chunk::indexEntities() {
+  grid.build([this](auto&& emit) {
+    entities.forEachArchetype([&emit](auto& archetype) {
+      for (int i = 0; i < archetype.size(); ++i) {
+        const Vector p = archetype.position(i);
+        emit(Grid::Entry{p.x, p.y, p.z, archetype.slot(i)});
+      }
+    });
+  });
 }
 
+void Chunk::processEntities(float dt) {
+  entities.update(dt);
+}
+
+template<class F>
+void Chunk::emigrate(F&& leave) {
+  const int here = coordinate();
+  const float low = here * WIDTH;
+  entities.forEachArchetype([this, here, low, &leave](auto& archetype) {
+    if (archetype.insideX(low, low + WIDTH)) {
+      return;
+    }
+    archetype.resetBoundsX();
+    for (int i = 0; i < archetype.size(); ++i) {
+      const float x = archetype.position(i).x;
+      const int owner = coordinateOf(x);
+      if (owner == here ||
+          !leave(archetype.get(i), entities.handle(archetype.slot(i)), owner)) {
+        archetype.includeX(x);
+      }
+    }
+  });
+}
+
+struct FrameStats {
+  int chunksRegenerated;
+  //Chunks whose entities were updated this frame, see Game::TIER_RADIUS.
+  int chunksTicked;
+  unsigned int totalRegenerated;
+  int entitiesNearPlayer;
+  //Migrants their new chunk couldn't take this frame, because the page pool
+  //ran out or with compact positions they were too far from the rest of
+  //their type. They stay where they were and try again next tick.
+  int entitiesTurnedAway;
+  //Chunks whose blocks came from Chunk::cache() or were generated, so far.
+  //Both 0 without CHUNK_CACHE.
+  unsigned long cacheHits;
+  unsigned long cacheMisses;
+};
+
+/*
+ * A frame is a TaskGraph of phases, built once in the constructor:
+ *
+ *   processEntities -- migrateEntities --\
+ *                                         >-- regenerateChunks -- updateStats
+ *   decideStreaming ----------------------/
+ *
+ * Streaming only reads chunk locations, which nothing else writes until
+ * regeneration, so it overlaps with the entity updates.
+ *
+ * Entities that leave their chunk during processEntities are handed over in
+ * three steps. The worker updating the source chunk books a place in the
+ * destination (an atomic per chunk, so a full chunk turns them away) and
+ * drops a copy of the entity in its own outbox, which only it writes to.
+ * After the barrier migrateEntities has each chunk add what every outbox
+ * holds for it, again one task per worker, and mark which got in. After
+ * another, each source chunk removes the ones that did. No locks, and an
+ * entity is never out of every chunk: one its destination can't take, for
+ * lack of pages, stays where it was. So do entities headed for a chunk
+ * that isn't loaded, or is full.
+ *
+ * Far chunks tick less often. The farther TIER_RADIUS a chunk is past, the
+ * longer it goes between updates, up to every 8th frame, and it then moves
+ * its entities by every frame it skipped at once. Chunks of a tier are
+ * staggered by slot so each frame does an even share of them. Only chunks
+ * that ticked or took in migrants rebuild their grid.
+ *
+ * regenerateChunks only starts the rebuilds, as jobs on the background lane,
+ * so they fill idle workers instead of stretching the frame. A rebuild
+ * generates the chunk's terrain, or with CHUNK_CACHE takes it from
+ * Chunk::cache() if it was generated not long ago, and copies Chunk::prototype()'s
+ * entities. It requeues itself after every section it generates, so frame
+ * work that comes in meanwhile goes first, see Chunk::generate. A chunk is
+ * left out of the frame while m_regenerating is set, for as many frames as
+ * that takes.
+ */
 class Game {
 public:
   static constexpr int CHUNK_COUNT = 100;
+  //Keeps the workers hot across the phases of a frame, not between frames.
+  static constexpr std::chrono::microseconds SPIN_BUDGET{200};
+  static constexpr bool PIN_WORKERS = true;
+  static constexpr float AGGRO_RADIUS = 32.0f;
+  //Chunks closer to the player than TIER_RADIUS[t] tick every 2^t frames,
+  //the rest every 2^(TIER_COUNT-1).
+  static constexpr int TIER_COUNT = 4;
+  static constexpr float TIER_RADIUS[TIER_COUNT - 1] = {8, 16, 32};
+  //Ticks of simulated time per frame.
+  static constexpr float FRAME_DT = 1.0f;
+  //Chunks per slab of m_chunkPool.
+  static constexpr int CHUNK_SLAB = 16;
   std::array<Block, 256> blocks;
-  std::array<Chunk, CHUNK_COUNT> chunks;
+  //From m_chunkPool. A slot keeps its chunk, regenerating rewrites it in place.
+  std::array<Chunk*, CHUNK_COUNT> chunks;
   Vector playerLocation;
   std::atomic_uint chunkCounter;
+  FrameStats stats;
   matan::ThreadPool m_threadPool;
   Game();
   void loadWorld();
   void updateChunks();
-  static void update(Chunk& chunk,
-                     const Vector playerLocation,
-                     std::atomic_uint& chunkCounter);
+  /*
+   * f(entity) for each entity within radius of center, in world units.
+   * Sees positions as of the end of the last tick. Only between frames, or
+   * from phases after migrateEntities.
+   */
+  template<class F> void forEachEntityNear(Vector center, float radius, F&& f);
+
+private:
+  struct Migrant {
+    Entity entity;
+    //Set by the destination once it has added entity.
+    bool arrived;
+  };
+  //Entities bound for each chunk, bucketed by slot in chunks.
+  struct alignas(64) Outbox {
+    std::array<std::vector<Migrant>, CHUNK_COUNT> to;
+  };
+  //Where a chunk's emigrant went in the outboxes, for it to look up later.
+  struct Departure {
+    EntityStore::Handle handle;
+    int outbox;
+    int to;
+    int index;
+  };
+
+  matan::SlabPool<Chunk, CHUNK_SLAB> m_chunkPool;
+  matan::TaskGraph m_frame;
+  std::array<int, CHUNK_COUNT> m_regenerate;
+  int m_regenerateCount;
+  std::array<std::atomic_bool, CHUNK_COUNT> m_regenerating;
+  //(coordinate, slot) of the chunks that can take entities, sorted.
+  std::array<std::pair<int, int>, CHUNK_COUNT> m_chunkIndex;
+  int m_chunkIndexSize;
+  //Free places per chunk, counted down as migrants book them.
+  std::array<std::atomic_int, CHUNK_COUNT> m_room;
+  std::atomic_int m_turnedAway;
+  long m_frameNumber;
+  //Frame each chunk last ticked, NEVER for one that hasn't since regenerating.
+  static constexpr long NEVER = -1;
+  std::array<long, CHUNK_COUNT> m_lastTick;
+  std::array<bool, CHUNK_COUNT> m_ticked;
+  //Whether each chunk took in any migrants this frame.
+  std::array<bool, CHUNK_COUNT> m_arrivals;
+  std::vector<Outbox> m_outboxes;
+  //Each chunk's emigrants this frame, written only by the worker ticking it.
+  std::array<std::vector<Departure>, CHUNK_COUNT> m_departures;
+
+  void buildFrame();
+  void indexChunks();
+  int findChunk(int coordinate) const;
+  bool reserve(int slot);
+  //Frames between updates of chunk, by its distance from the player.
+  int tickPeriod(int chunk) const;
+  bool tick(int chunk);
+  void processEntities();
+  void migrateEntities();
+  void decideStreaming();
+  void regenerateChunks();
+  matan::Job<> regenerate(int chunk);
+  void updateStats();
 };
 
 Game::Game() :
     playerLocation({0, 0, 0}),
-    m_threadPool() {
+    m_threadPool(std::thread::hardware_concurrency(),
+                 matan::ThreadPool::Scheduling::WorkStealing) {
   for (int i = 0; i < blocks.size(); i+=4) {
     matan::place(&blocks[i], "Block" + std::to_string(i), Vector(i,i,i), i, 100, 1, 1, true, true);
     matan::place(&blocks[i+1], "Block" + std::to_string(i+1), Vector(i+1,i+1,i+1), i+1, 100, 1, 1, true, true);
@@ -210,35 +1110,247 @@ Game::Game() :
   }
 
   chunkCounter = 0;
+  stats = FrameStats{0, 0, 0, 0, 0, 0, 0};
+  m_frameNumber = 0;
+  m_lastTick.fill(0);
+  m_ticked.fill(false);
+  m_arrivals.fill(false);
+  m_turnedAway = 0;
+  m_regenerateCount = 0;
+  for (auto& regenerating : m_regenerating) {
+    regenerating = false;
+  }
+  m_chunkIndexSize = 0;
+  m_outboxes = std::vector<Outbox>(m_threadPool.numThreads());
+  m_threadPool.setSpinBudget(SPIN_BUDGET);
+  if (PIN_WORKERS) {
+    //Consecutive workers on one node, so do the chunks they own.
+    const auto topology = matan::Topology::detect();
+    m_threadPool.pinWorkers(topology.compactLayout(m_threadPool.numThreads()));
+  }
+  buildFrame();
+}
+
+void Game::buildFrame() {
+  auto entities = m_frame.add([this]() { processEntities(); });
+  auto migrate = m_frame.add([this]() { migrateEntities(); });
+  auto streaming = m_frame.add([this]() { decideStreaming(); });
+  auto regenerate = m_frame.add([this]() { regenerateChunks(); });
+  auto frameStats = m_frame.add([this]() { updateStats(); });
+  m_frame.precede(entities, migrate);
+  m_frame.precede(migrate, regenerate);
+  m_frame.precede(streaming, regenerate);
+  m_frame.precede(regenerate, frameStats);
 }
 
+/*
+ * Each chunk is built, and so first touched, by the worker that updates it
+ * every frame, which puts its pages on that worker's NUMA node.
+ */
 void Game::loadWorld() {
-  for (int i = 0; i < chunks.size(); i+=4) {
-    matan::place(&chunks[i], Vector(chunkCounter++, 0.0, 0.0));
-    matan::place(&chunks[i+1], Vector(chunkCounter++, 0.0, 0.0));
-    matan::place(&chunks[i+2], Vector(chunkCounter++, 0.0, 0.0));
-    matan::place(&chunks[i+3], Vector(chunkCounter++, 0.0, 0.0));
+  const unsigned int first = chunkCounter;
+  chunkCounter += CHUNK_COUNT;
+  m_threadPool.parallel_for(0, CHUNK_COUNT, 1, [this, first](int i) {
+    chunks[i] = m_chunkPool.acquire(Vector(first + i, 0.0, 0.0));
+  }, matan::ThreadPool::Partitioner::Affine);
+}
+
+/*
+ * Chunks being regenerated are left out, their entities are about to be
+ * replaced. Nothing sets m_regenerating again until after migration.
+ */
+void Game::indexChunks() {
+  m_chunkIndexSize = 0;
+  for (int i = 0; i < CHUNK_COUNT; ++i) {
+    if (m_regenerating[i]) {
+      continue;
+    }
+    m_chunkIndex[m_chunkIndexSize++] = {chunks[i]->coordinate(), i};
+    m_room[i] = EntityStore::CAPACITY - chunks[i]->entities.size();
   }
+  std::sort(m_chunkIndex.begin(), m_chunkIndex.begin() + m_chunkIndexSize);
+}
+
+//Slot of the chunk at coordinate, or -1 if it can't take entities.
+int Game::findChunk(int coordinate) const {
+  auto end = m_chunkIndex.begin() + m_chunkIndexSize;
+  auto it = std::lower_bound(m_chunkIndex.begin(), end, std::make_pair(coordinate, -1));
+  return it != end && it->first == coordinate ? it->second : -1;
 }
 
-void Game::update(Chunk& chunk,
-                  const Vector playerLocation,
-                  std::atomic_uint& chunkCounter) {
-  chunk.processEntities();
-  if (Vector::getDistance(chunk.location, playerLocation) > CHUNK_COUNT) {
-    matan::replace(&chunk, chunkCounter++, 0, 0);
+bool Game::reserve(int slot) {
+  std::atomic_int& room = m_room[slot];
+  if (room.fetch_sub(1) > 0) {
+    return true;
+  }
+  ++room;
+  return false;
+}
+
+int Game::tickPeriod(int chunk) const {
+  const float distance = Vector::getDistance(chunks[chunk]->location, playerLocation);
+  int tier = 0;
+  while (tier < TIER_COUNT - 1 && distance >= TIER_RADIUS[tier]) {
+    ++tier;
+  }
+  return 1 << tier;
+}
+
+//Updates chunk if it's due this frame, by every frame since it last did.
+bool Game::tick(int chunk) {
+  if (m_lastTick[chunk] == NEVER) {
+    m_lastTick[chunk] = m_frameNumber - 1;
+  }
+  //Staggered by slot, so a tier's chunks take turns.
+  if ((m_frameNumber + chunk) % tickPeriod(chunk) != 0) {
+    return false;
   }
+  chunks[chunk]->processEntities((m_frameNumber - m_lastTick[chunk]) * FRAME_DT);
+  m_lastTick[chunk] = m_frameNumber;
+  return true;
+}
+
+void Game::processEntities() {
+  indexChunks();
+  //One task per worker, each walking the run of chunks it loaded.
+  m_threadPool.parallel_for(0, CHUNK_COUNT, 1, [this](int i) {
+    m_ticked[i] = false;
+    if (m_regenerating[i] || !tick(i)) {
+      return;
+    }
+    m_ticked[i] = true;
+    const int worker = m_threadPool.currentWorker();
+    Outbox& outbox = m_outboxes[worker];
+    chunks[i]->emigrate([this, i, worker, &outbox](const Entity& entity,
+                                                   EntityStore::Handle handle,
+                                                   int coordinate) {
+      const int slot = findChunk(coordinate);
+      if (slot < 0 || !reserve(slot)) {
+        return false;
+      }
+      m_departures[i].push_back({handle, worker, slot, (int)outbox.to[slot].size()});
+      outbox.to[slot].push_back({entity, false});
+      return true;
+    });
+  }, matan::ThreadPool::Partitioner::Affine);
+}
+
+void Game::migrateEntities() {
+  //Each chunk only touches its own bucket of every outbox.
+  m_threadPool.parallel_for(0, CHUNK_COUNT, 1, [this](int i) {
+    m_arrivals[i] = false;
+    for (Outbox& outbox : m_outboxes) {
+      for (Migrant& migrant : outbox.to[i]) {
+        migrant.arrived = chunks[i]->entities.add(migrant.entity);
+        m_arrivals[i] |= migrant.arrived;
+        if (!migrant.arrived) {
+          ++m_turnedAway;
+        }
+      }
+    }
+  }, matan::ThreadPool::Partitioner::Affine);
+  //Each chunk only reads the migrants it sent.
+  m_threadPool.parallel_for(0, CHUNK_COUNT, 1, [this](int i) {
+    bool changed = m_ticked[i] || m_arrivals[i];
+    for (const Departure& departure : m_departures[i]) {
+      if (m_outboxes[departure.outbox].to[departure.to][departure.index].arrived) {
+        chunks[i]->entities.remove(departure.handle);
+        changed = true;
+      } else {
+        chunks[i]->entities.includeX(departure.handle);
+      }
+    }
+    //clear() keeps the capacity, later frames don't allocate.
+    m_departures[i].clear();
+    if (changed && !m_regenerating[i]) {
+      chunks[i]->indexEntities();
+    }
+  }, matan::ThreadPool::Partitioner::Affine);
+  for (Outbox& outbox : m_outboxes) {
+    for (auto& bucket : outbox.to) {
+      bucket.clear();
+    }
+  }
+}
+
+template<class F>
+void Game::forEachEntityNear(Vector center, float radius, F&& f) {
+  //Only chunks whose slab of x overlaps the sphere can hold any.
+  const int first = Chunk::coordinateOf(center.x - radius);
+  const int last = Chunk::coordinateOf(center.x + radius);
+  for (int coordinate = first; coordinate <= last; ++coordinate) {
+    const int slot = findChunk(coordinate);
+    if (slot < 0 || m_regenerating[slot]) {
+      continue;
+    }
+    const Chunk& chunk = *chunks[slot];
+    chunk.grid.forEachInRadius(center.x, center.y, center.z, radius,
+                               [&chunk, &f](const Chunk::Grid::Entry& e) {
+      f(chunk.entity(e.id));
+    });
+  }
+}
+
+void Game::decideStreaming() {
+  m_regenerateCount = 0;
+  for (int i = 0; i < CHUNK_COUNT; ++i) {
+    if (m_regenerating[i]) {
+      continue;
+    }
+    if (Vector::getDistance(chunks[i]->location, playerLocation) > CHUNK_COUNT) {
+      m_regenerate[m_regenerateCount++] = i;
+    }
+  }
+}
+
+void Game::regenerateChunks() {
+  for (int i = 0; i < m_regenerateCount; ++i) {
+    const int chunk = m_regenerate[i];
+    m_regenerating[chunk] = true;
+    regenerate(chunk).detach(m_threadPool, matan::ThreadPool::Priority::Background);
+  }
+}
+
+matan::Job<> Game::regenerate(int chunk) {
+  //Over the old chunk, keeping its pages and the sections it has to itself.
+  co_await chunks[chunk]->generate(m_threadPool, Vector(chunkCounter++, 0, 0));
+  m_lastTick[chunk] = NEVER;
+  m_regenerating[chunk] = false;
+}
+
+void Game::updateStats() {
+  stats.chunksRegenerated = m_regenerateCount;
+  stats.totalRegenerated += m_regenerateCount;
+  stats.entitiesTurnedAway = m_turnedAway.exchange(0);
+  stats.chunksTicked = std::count(m_ticked.begin(), m_ticked.end(), true);
+  stats.cacheHits = Chunk::cache().hits();
+  stats.cacheMisses = Chunk::cache().misses();
+  //playerLocation counts in chunks along x, like Chunk::location.
+  const Vector player(playerLocation.x * Chunk::WIDTH, playerLocation.y, playerLocation.z);
+  stats.entitiesNearPlayer = 0;
+  forEachEntityNear(player, AGGRO_RADIUS, [this](const Entity&) {
+    ++stats.entitiesNearPlayer;
+  });
 }
 
 void Game::updateChunks() {
-  for (int i = 0; i < chunks.size(); i+=4) {
-    m_threadPool.enqueue(Game::update, chunks[i], playerLocation, chunkCounter);
-    m_threadPool.enqueue(Game::update, chunks[i+1], playerLocation, chunkCounter);
-    m_threadPool.enqueue(Game::update, chunks[i+2], playerLocation, chunkCounter);
-    m_threadPool.enqueue(Game::update, chunks[i+3], playerLocation, chunkCounter);
+  ++m_frameNumber;
+  m_frame.run(m_threadPool);
+}
+
+#ifdef MATAN_THREADPOOL_STATS
+//One line per frame: busy/idle ms and tasks per worker, then pool wide figures.
+void printThreadPoolStats(const matan::ThreadPool::Stats& stats) {
+  for (auto& worker : stats.workers) {
+    printf("  %.2f/%.2f/%lu", worker.busy.count() / 1e6, worker.idle.count() / 1e6,
+           (unsigned long)worker.tasks);
   }
-  m_threadPool.waitFinished();
+  const double meanLatency = stats.started == 0 ? 0 :
+      stats.totalStartLatency.count() / 1e3 / stats.started;
+  printf("  depth %u  latency %.1f/%.1fus  stall %.2fms\n", stats.queueHighWater,
+         meanLatency, stats.maxStartLatency.count() / 1e3, stats.waitStall.count() / 1e6);
 }
+#endif
 
 int main(int argc, char* argv[]) {
   auto game = new Game;
@@ -252,6 +1364,15 @@ int main(int argc, char* argv[]) {
   end = high_resolution_clock::now();
   auto duration = duration_cast<milliseconds>(end-start).count();
   printf("load time:%lu\n",duration);
+  size_t blockBytes = 0;
+  for (auto& chunk : game->chunks) {
+    blockBytes += chunk->blocks.bytes();
+  }
+  printf("block memory:%luKB\n", blockBytes / 1024);
+  if (CHUNK_CACHE) {
+    printf("chunk cache:%d chunks %luKB of %luKB\n", Chunk::cache().size(),
+           Chunk::cache().bytes() / 1024, Chunk::cache().budget() / 1024);
+  }
 
   int i = 0;
   double dur = 0;
@@ -264,6 +1385,10 @@ int main(int argc, char* argv[]) {
 
     auto duration = (double)(duration_cast<nanoseconds>(end-start).count() / 1000000.0);
     printf("%f\n",duration);
+#ifdef MATAN_THREADPOOL_STATS
+    printThreadPoolStats(game->m_threadPool.stats());
+    game->m_threadPool.resetStats();
+#endif
     if(duration < 16) {
       this_thread::sleep_for(milliseconds((long)(16.0-duration)));
     }
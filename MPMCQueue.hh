@@ -0,0 +1,123 @@
+/*
+ * Bounded lock-free multi-producer/multi-consumer queue.
+ * credit: Dmitry Vyukov's bounded MPMC queue
+ * http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ *
+ * Every slot carries a sequence number saying whose turn it is. A producer
+ * may fill slot i when its sequence is i, and publishes it by setting it to
+ * i + 1. A consumer may empty it when its sequence is i + 1, and hands it
+ * back to the next lap of producers by setting it to i + capacity. Claiming
+ * a turn is one CAS on the enqueue or dequeue position, so producers and
+ * consumers never wait on each other unless the queue is full or empty.
+ *
+ * All slots are allocated up front; nothing allocates after construction.
+ */
+
+#ifndef MATAN_MPMCQUEUE_HH
+#define MATAN_MPMCQUEUE_HH
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace matan {
+  template<class T>
+  class MPMCQueue {
+  public:
+    //capacity is rounded up to a power of 2.
+    explicit MPMCQueue(std::size_t capacity);
+    MPMCQueue(const MPMCQueue&) = delete;
+    MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+    //false if the queue is full, value is left untouched.
+    bool tryPush(T&& value);
+    //false if the queue is empty.
+    bool tryPop(T& value);
+    std::size_t capacity() const { return m_mask + 1; };
+
+  private:
+    static constexpr std::size_t CACHE_LINE = 64;
+
+    struct alignas(CACHE_LINE) Cell {
+      std::atomic<std::size_t> sequence;
+      T value;
+    };
+
+    std::unique_ptr<Cell[]> m_cells;
+    const std::size_t m_mask;
+    //Producers and consumers each hammer their own line.
+    alignas(CACHE_LINE) std::atomic<std::size_t> m_enqueue;
+    alignas(CACHE_LINE) std::atomic<std::size_t> m_dequeue;
+
+    static std::size_t roundUp(std::size_t n);
+  };
+
+  template<class T>
+  std::size_t MPMCQueue<T>::roundUp(std::size_t n) {
+    std::size_t size = 2;
+    while (size < n) {
+      size *= 2;
+    }
+    return size;
+  }
+
+  template<class T>
+  MPMCQueue<T>::MPMCQueue(std::size_t capacity) :
+      m_cells(new Cell[roundUp(capacity)]),
+      m_mask(roundUp(capacity) - 1),
+      m_enqueue(0),
+      m_dequeue(0) {
+    for (std::size_t i = 0; i <= m_mask; ++i) {
+      m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  template<class T>
+  bool MPMCQueue<T>::tryPush(T&& value) {
+    std::size_t pos = m_enqueue.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = m_cells[pos & m_mask];
+      const std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+      const std::ptrdiff_t diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)pos;
+      if (diff == 0) {
+        if (m_enqueue.compare_exchange_weak(pos, pos + 1,
+                                            std::memory_order_relaxed)) {
+          cell.value = std::move(value);
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        //A lap behind, the consumers haven't freed this slot yet.
+        return false;
+      } else {
+        pos = m_enqueue.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  template<class T>
+  bool MPMCQueue<T>::tryPop(T& value) {
+    std::size_t pos = m_dequeue.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = m_cells[pos & m_mask];
+      const std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+      const std::ptrdiff_t diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)(pos + 1);
+      if (diff == 0) {
+        if (m_dequeue.compare_exchange_weak(pos, pos + 1,
+                                            std::memory_order_relaxed)) {
+          value = std::move(cell.value);
+          cell.sequence.store(pos + m_mask + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        //Nothing published here yet.
+        return false;
+      } else {
+        pos = m_dequeue.load(std::memory_order_relaxed);
+      }
+    }
+  }
+} //namespace matan
+
+#endif //MATAN_MPMCQUEUE_HH
@@ -0,0 +1,302 @@
+/*
+ * Palette compressed storage for SIZE block ids (unsigned char).
+ *
+ * The distinct ids go in a palette, and each block stores its index into
+ * the palette, packed 1, 2, 4 or 8 bits to a block into 64 bit words: as
+ * few as the palette needs. Widths are powers of 2 so no index straddles
+ * two words, and get/set are a shift and a mask. While every block is the
+ * same there are no words at all. At 8 bits every id fits, so the words
+ * hold the ids themselves and there is no palette.
+ *
+ * The width only grows, on the set() that brings in one id too many for
+ * it. encode() writes a run of blocks with at most one repack, so prefer
+ * it for filling a chunk. The words are one slice of a PagePool page, just
+ * as many bytes as the width needs: SIZE / 8 at 1 bit, so eight sections of
+ * two ids share a page. Not thread safe.
+ */
+
+#ifndef MATAN_PALETTESTORAGE_HH
+#define MATAN_PALETTESTORAGE_HH
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "SlotMap.hh"
+
+namespace matan {
+  template<int SIZE>
+  class PaletteStorage {
+  public:
+    static constexpr int MAX_BITS = 8;
+    //Most ids below MAX_BITS, where the words stop needing a palette.
+    static constexpr int MAX_PALETTE = 16;
+    static_assert(SIZE % 64 == 0, "PaletteStorage: SIZE must fill whole words");
+    static_assert(SIZE / 8 * MAX_BITS <= (int)PagePool::PAGE_BYTES,
+                  "PaletteStorage: the widest words must fit one page");
+
+    //Every block starts out id 0.
+    explicit PaletteStorage(PagePool& pool);
+    PaletteStorage(const PaletteStorage&) = delete;
+    PaletteStorage& operator=(const PaletteStorage&) = delete;
+    ~PaletteStorage() { release(); }
+    int size() const { return SIZE; };
+    unsigned char get(int i) const { return palette()[m_bits == 0 ? 0 : index(m_words, i, m_log2Bits)]; };
+    unsigned char operator[](int i) const { return get(i); };
+    //false, and nothing changes, if widening needed memory it couldn't get.
+    bool set(int i, unsigned char id);
+    //Every block = id. Gives back the words.
+    void fill(unsigned char id);
+    //Same blocks as other, false if there wasn't the memory for them.
+    bool copyFrom(const PaletteStorage& other);
+    //out[0, count) = the ids of blocks [first, first + count).
+    void decode(int first, int count, unsigned char* out) const;
+    //Blocks [first, first + count) = in[0, count), widening at most once.
+    bool encode(int first, int count, const unsigned char* in);
+    //Bits per block, 0 while they're all the same.
+    int bits() const { return m_bits; };
+    //Ids the blocks can hold without widening; 256 at MAX_BITS.
+    int paletteSize() const { return m_paletteSize; };
+    //Resident bytes: the packed words and this object.
+    std::size_t bytes() const { return wordBytes(m_bits) + sizeof(*this); };
+
+  private:
+    typedef std::uint64_t Word;
+    static constexpr unsigned char ABSENT = 0xff;
+
+    PagePool& m_pool;
+    Word* m_words;  //nullptr while m_bits is 0
+    int m_bits;
+    int m_log2Bits;
+    int m_paletteSize;
+    std::array<unsigned char, MAX_PALETTE> m_palette;
+
+    //Index -> id at MAX_BITS, where they're the same.
+    static constexpr std::array<unsigned char, 256> IDENTITY = [] {
+      std::array<unsigned char, 256> ids{};
+      for (int id = 0; id < 256; ++id) {
+        ids[id] = (unsigned char)id;
+      }
+      return ids;
+    }();
+
+    static std::size_t wordBytes(int bits) { return SIZE / 8 * bits; };
+    const unsigned char* palette() const {
+      return m_bits == MAX_BITS ? IDENTITY.data() : m_palette.data();
+    };
+    //id -> index for every id, ABSENT for those not in the palette. Below
+    //MAX_BITS no index is ABSENT.
+    void indexTable(std::array<unsigned char, 256>& indexOf) const;
+    //Index of block i, for a width of 1 << log2Bits.
+    static Word index(const Word* words, int i, int log2Bits);
+    static void setIndex(Word* words, int i, Word index, int log2Bits);
+    bool widen(int bits);
+    void release();
+  };
+
+  template<int SIZE>
+  PaletteStorage<SIZE>::PaletteStorage(PagePool& pool) : m_pool(pool), m_words(nullptr) {
+    fill(0);
+  }
+
+  template<int SIZE>
+  void PaletteStorage<SIZE>::release() {
+    if (m_words) {
+      m_pool.releaseSlice(m_words, wordBytes(m_bits));
+      m_words = nullptr;
+    }
+  }
+
+  template<int SIZE>
+  void PaletteStorage<SIZE>::fill(unsigned char id) {
+    release();
+    m_bits = 0;
+    m_log2Bits = 0;
+    m_palette[0] = id;
+    m_paletteSize = 1;
+  }
+
+  template<int SIZE>
+  bool PaletteStorage<SIZE>::copyFrom(const PaletteStorage& other) {
+    Word* words = nullptr;
+    if (other.m_words) {
+      words = static_cast<Word*>(m_pool.allocateSlice(wordBytes(other.m_bits)));
+      if (!words) {
+        return false;
+      }
+      std::memcpy(words, other.m_words, wordBytes(other.m_bits));
+    }
+    release();
+    m_words = words;
+    m_bits = other.m_bits;
+    m_log2Bits = other.m_log2Bits;
+    m_paletteSize = other.m_paletteSize;
+    m_palette = other.m_palette;
+    return true;
+  }
+
+  template<int SIZE>
+  void PaletteStorage<SIZE>::indexTable(std::array<unsigned char, 256>& indexOf) const {
+    if (m_bits == MAX_BITS) {
+      indexOf = IDENTITY;
+      return;
+    }
+    indexOf.fill(ABSENT);
+    for (int k = 0; k < m_paletteSize; ++k) {
+      indexOf[m_palette[k]] = (unsigned char)k;
+    }
+  }
+
+  template<int SIZE>
+  typename PaletteStorage<SIZE>::Word
+  PaletteStorage<SIZE>::index(const Word* words, int i, int log2Bits) {
+    const int perWordLog2 = 6 - log2Bits;
+    const int shift = (i & ((1 << perWordLog2) - 1)) << log2Bits;
+    return (words[i >> perWordLog2] >> shift) & ((Word(1) << (1 << log2Bits)) - 1);
+  }
+
+  template<int SIZE>
+  void PaletteStorage<SIZE>::setIndex(Word* words, int i, Word index, int log2Bits) {
+    const int perWordLog2 = 6 - log2Bits;
+    const int shift = (i & ((1 << perWordLog2) - 1)) << log2Bits;
+    const Word mask = ((Word(1) << (1 << log2Bits)) - 1) << shift;
+    Word& word = words[i >> perWordLog2];
+    word = (word & ~mask) | (index << shift);
+  }
+
+  template<int SIZE>
+  bool PaletteStorage<SIZE>::set(int i, unsigned char id) {
+    //The palette is at most MAX_PALETTE long, a scan is as quick as a table.
+    int index = m_bits == MAX_BITS ? id : -1;
+    for (int k = 0; k < m_paletteSize && index < 0; ++k) {
+      index = m_palette[k] == id ? k : -1;
+    }
+    if (index < 0) {
+      if (m_paletteSize == 1 << m_bits && !widen(m_bits == 0 ? 1 : m_bits * 2)) {
+        return false;
+      }
+      if (m_bits == MAX_BITS) {
+        index = id;
+      } else {
+        index = m_paletteSize;
+        m_palette[m_paletteSize++] = id;
+      }
+    }
+    if (m_bits != 0) {
+      setIndex(m_words, i, index, m_log2Bits);
+    }
+    return true;
+  }
+
+  template<int SIZE>
+  bool PaletteStorage<SIZE>::encode(int first, int count, const unsigned char* in) {
+    //Count the new ids first, so there's one repack at most.
+    std::array<unsigned char, 256> indexOf;
+    indexTable(indexOf);
+    std::array<bool, 256> seen{};
+    int added = 0;
+    for (int k = 0; k < count && m_bits != MAX_BITS; ++k) {
+      if (indexOf[in[k]] == ABSENT && !seen[in[k]]) {
+        seen[in[k]] = true;
+        ++added;
+      }
+    }
+    if (added > 0) {
+      int bits = m_bits;
+      while ((1 << bits) < m_paletteSize + added) {
+        bits = bits == 0 ? 1 : bits * 2;
+      }
+      if (bits != m_bits && !widen(bits)) {
+        return false;
+      }
+      if (m_bits != MAX_BITS) {
+        for (int id = 0; id < 256; ++id) {
+          if (seen[id]) {
+            m_palette[m_paletteSize++] = (unsigned char)id;
+          }
+        }
+      }
+      indexTable(indexOf);
+    }
+    if (m_bits == 0) {
+      return true;
+    }
+    //Whole words are built in a register, only the ends are patched.
+    const int perWordLog2 = 6 - m_log2Bits;
+    const int perWord = 1 << perWordLog2;
+    const int end = first + count;
+    int i = first;
+    for (; i < end && (i & (perWord - 1)) != 0; ++i) {
+      setIndex(m_words, i, indexOf[in[i - first]], m_log2Bits);
+    }
+    for (; i + perWord <= end; i += perWord) {
+      Word word = 0;
+      for (int k = 0; k < perWord; ++k) {
+        word |= Word(indexOf[in[i - first + k]]) << (k << m_log2Bits);
+      }
+      m_words[i >> perWordLog2] = word;
+    }
+    for (; i < end; ++i) {
+      setIndex(m_words, i, indexOf[in[i - first]], m_log2Bits);
+    }
+    return true;
+  }
+
+  template<int SIZE>
+  bool PaletteStorage<SIZE>::widen(int bits) {
+    Word* words = static_cast<Word*>(m_pool.allocateSlice(wordBytes(bits)));
+    if (!words) {
+      return false;
+    }
+    int log2Bits = 0;
+    while ((1 << log2Bits) < bits) {
+      ++log2Bits;
+    }
+    if (m_bits == 0) {
+      //Every block is index 0, or at MAX_BITS the one id.
+      std::memset(words, bits == MAX_BITS ? m_palette[0] : 0, wordBytes(bits));
+    } else {
+      //Into the bigger slice; at MAX_BITS indices turn into ids.
+      const unsigned char* to = bits == MAX_BITS ? m_palette.data() : IDENTITY.data();
+      std::memset(words, 0, wordBytes(bits));
+      for (int i = 0; i < SIZE; ++i) {
+        setIndex(words, i, to[index(m_words, i, m_log2Bits)], log2Bits);
+      }
+    }
+    release();
+    m_words = words;
+    m_bits = bits;
+    m_log2Bits = log2Bits;
+    if (bits == MAX_BITS) {
+      m_paletteSize = 256;
+    }
+    return true;
+  }
+
+  template<int SIZE>
+  void PaletteStorage<SIZE>::decode(int first, int count, unsigned char* out) const {
+    if (m_bits == 0) {
+      std::memset(out, m_palette[0], count);
+      return;
+    }
+    const unsigned char* ids = palette();
+    const int perWordLog2 = 6 - m_log2Bits;
+    const int perWord = 1 << perWordLog2;
+    const Word mask = (Word(1) << m_bits) - 1;
+    const int end = first + count;
+    //A word at a time, shifting each index out in turn.
+    for (int i = first; i < end; ) {
+      const int inWord = i & (perWord - 1);
+      Word word = m_words[i >> perWordLog2] >> (inWord << m_log2Bits);
+      const int n = std::min(end - i, perWord - inWord);
+      for (int k = 0; k < n; ++k) {
+        out[i - first + k] = ids[word & mask];
+        word >>= m_bits;
+      }
+      i += n;
+    }
+  }
+} //namespace matan
+
+#endif //MATAN_PALETTESTORAGE_HH
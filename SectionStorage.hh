@@ -0,0 +1,221 @@
+/*
+ * A chunk's block ids as SECTION_COUNT sections of SECTION_SIZE blocks,
+ * block i in section i / SECTION_SIZE. With y outermost in the block index,
+ * a section is a 16x16x16 cube and the sections stack vertically.
+ *
+ * A section that is all one id is just that id, with no storage: the air
+ * above terrain and the stone below it cost nothing, and scans can skip
+ * them (see uniform()). The others are a PaletteStorage each, held by
+ * shared_ptr so chunks can share identical sections. A shared section is
+ * copied on the first write to it, by whichever chunk writes, unless the
+ * write is an encode() of the whole section, which starts a new one.
+ *
+ * A chunk's own sections are not thread safe, but sharing is: one chunk
+ * copying a section on write never disturbs the others reading it.
+ */
+
+#ifndef MATAN_SECTIONSTORAGE_HH
+#define MATAN_SECTIONSTORAGE_HH
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include "PaletteStorage.hh"
+#include "SlotMap.hh"
+
+namespace matan {
+  template<int SECTION_COUNT, int SECTION_SIZE = 4096>
+  class SectionStorage {
+  public:
+    typedef PaletteStorage<SECTION_SIZE> Section;
+    static constexpr int SIZE = SECTION_COUNT * SECTION_SIZE;
+
+    //Every block starts out id 0.
+    explicit SectionStorage(PagePool& pool);
+    int size() const { return SIZE; };
+    unsigned char get(int i) const;
+    unsigned char operator[](int i) const { return get(i); };
+    //false, and nothing changes, if it needed memory it couldn't get.
+    bool set(int i, unsigned char id);
+    //Every block = id, every section uniform.
+    void fill(unsigned char id);
+    //out[0, count) = the ids of blocks [first, first + count).
+    void decode(int first, int count, unsigned char* out) const;
+    //Blocks [first, first + count) = in[0, count). Sections it covers with
+    //one id end up uniform.
+    bool encode(int first, int count, const unsigned char* in);
+
+    //true, and id set, if section s is all id.
+    bool uniform(int s, unsigned char& id) const;
+    //Section s's storage, nullptr if it's uniform.
+    std::shared_ptr<const Section> section(int s) const { return m_sections[s].data; };
+    //Make section s a share of section, copied when either side writes.
+    void share(int s, std::shared_ptr<Section> section);
+    //Same blocks as other, sharing every section other stores.
+    void copyFrom(const SectionStorage& other) { m_sections = other.m_sections; };
+    //Sections that aren't uniform.
+    int stored() const;
+    //Resident bytes: this object, plus each stored section's bytes divided
+    //by how many holders share it.
+    std::size_t bytes() const;
+    //This object and every stored section's bytes, shared or not: what
+    //holding on to a copy of it can keep resident.
+    std::size_t storedBytes() const;
+
+  private:
+    struct Slot {
+      std::shared_ptr<Section> data;  //nullptr while uniform
+      unsigned char id;               //the id of a uniform section
+    };
+
+    PagePool& m_pool;
+    std::array<Slot, SECTION_COUNT> m_sections;
+
+    //Section s, ready to write: copied if shared, created if uniform.
+    Section* writable(int s);
+  };
+
+  template<int SECTION_COUNT, int SECTION_SIZE>
+  SectionStorage<SECTION_COUNT, SECTION_SIZE>::SectionStorage(PagePool& pool) : m_pool(pool) {
+    fill(0);
+  }
+
+  template<int SECTION_COUNT, int SECTION_SIZE>
+  void SectionStorage<SECTION_COUNT, SECTION_SIZE>::fill(unsigned char id) {
+    for (Slot& slot : m_sections) {
+      slot.data.reset();
+      slot.id = id;
+    }
+  }
+
+  template<int SECTION_COUNT, int SECTION_SIZE>
+  unsigned char SectionStorage<SECTION_COUNT, SECTION_SIZE>::get(int i) const {
+    const Slot& slot = m_sections[i / SECTION_SIZE];
+    return slot.data ? slot.data->get(i % SECTION_SIZE) : slot.id;
+  }
+
+  template<int SECTION_COUNT, int SECTION_SIZE>
+  typename SectionStorage<SECTION_COUNT, SECTION_SIZE>::Section*
+  SectionStorage<SECTION_COUNT, SECTION_SIZE>::writable(int s) {
+    Slot& slot = m_sections[s];
+    //Only we hold it, nobody else can be reading it.
+    if (slot.data && slot.data.use_count() == 1) {
+      return slot.data.get();
+    }
+    std::shared_ptr<Section> section = std::make_shared<Section>(m_pool);
+    if (slot.data) {
+      if (!section->copyFrom(*slot.data)) {
+        return nullptr;
+      }
+    } else {
+      section->fill(slot.id);
+    }
+    slot.data = std::move(section);
+    return slot.data.get();
+  }
+
+  template<int SECTION_COUNT, int SECTION_SIZE>
+  bool SectionStorage<SECTION_COUNT, SECTION_SIZE>::set(int i, unsigned char id) {
+    const int s = i / SECTION_SIZE;
+    if (!m_sections[s].data && m_sections[s].id == id) {
+      return true;
+    }
+    Section* section = writable(s);
+    return section && section->set(i % SECTION_SIZE, id);
+  }
+
+  template<int SECTION_COUNT, int SECTION_SIZE>
+  void SectionStorage<SECTION_COUNT, SECTION_SIZE>::decode(int first, int count,
+                                                           unsigned char* out) const {
+    const int end = first + count;
+    for (int i = first; i < end; ) {
+      const Slot& slot = m_sections[i / SECTION_SIZE];
+      const int offset = i % SECTION_SIZE;
+      const int n = std::min(end - i, SECTION_SIZE - offset);
+      if (slot.data) {
+        slot.data->decode(offset, n, out + (i - first));
+      } else {
+        std::memset(out + (i - first), slot.id, n);
+      }
+      i += n;
+    }
+  }
+
+  template<int SECTION_COUNT, int SECTION_SIZE>
+  bool SectionStorage<SECTION_COUNT, SECTION_SIZE>::encode(int first, int count,
+                                                           const unsigned char* in) {
+    const int end = first + count;
+    for (int i = first; i < end; ) {
+      const int s = i / SECTION_SIZE;
+      const int offset = i % SECTION_SIZE;
+      const int n = std::min(end - i, SECTION_SIZE - offset);
+      const unsigned char* run = in + (i - first);
+      const bool same = std::all_of(run, run + n, [run](unsigned char id) { return id == run[0]; });
+      Slot& slot = m_sections[s];
+      if (same && n == SECTION_SIZE) {
+        slot.data.reset();
+        slot.id = run[0];
+      } else if (n == SECTION_SIZE && slot.data.use_count() != 1) {
+        //Every block is rewritten: a new section, not a copy of the old one.
+        std::shared_ptr<Section> section = std::make_shared<Section>(m_pool);
+        if (!section->encode(0, n, run)) {
+          return false;
+        }
+        slot.data = std::move(section);
+      } else if (!(same && !slot.data && slot.id == run[0])) {
+        Section* section = writable(s);
+        if (!section || !section->encode(offset, n, run)) {
+          return false;
+        }
+      }
+      i += n;
+    }
+    return true;
+  }
+
+  template<int SECTION_COUNT, int SECTION_SIZE>
+  bool SectionStorage<SECTION_COUNT, SECTION_SIZE>::uniform(int s, unsigned char& id) const {
+    if (m_sections[s].data) {
+      return false;
+    }
+    id = m_sections[s].id;
+    return true;
+  }
+
+  template<int SECTION_COUNT, int SECTION_SIZE>
+  void SectionStorage<SECTION_COUNT, SECTION_SIZE>::share(int s, std::shared_ptr<Section> section) {
+    m_sections[s].data = std::move(section);
+  }
+
+  template<int SECTION_COUNT, int SECTION_SIZE>
+  int SectionStorage<SECTION_COUNT, SECTION_SIZE>::stored() const {
+    return std::count_if(m_sections.begin(), m_sections.end(),
+                         [](const Slot& slot) { return slot.data != nullptr; });
+  }
+
+  template<int SECTION_COUNT, int SECTION_SIZE>
+  std::size_t SectionStorage<SECTION_COUNT, SECTION_SIZE>::bytes() const {
+    std::size_t total = sizeof(*this);
+    for (const Slot& slot : m_sections) {
+      if (slot.data) {
+        total += slot.data->bytes() / slot.data.use_count();
+      }
+    }
+    return total;
+  }
+
+  template<int SECTION_COUNT, int SECTION_SIZE>
+  std::size_t SectionStorage<SECTION_COUNT, SECTION_SIZE>::storedBytes() const {
+    std::size_t total = sizeof(*this);
+    for (const Slot& slot : m_sections) {
+      if (slot.data) {
+        total += slot.data->bytes();
+      }
+    }
+    return total;
+  }
+} //namespace matan
+
+#endif //MATAN_SECTIONSTORAGE_HH
@@ -0,0 +1,410 @@
+/*
+ * Paged storage for things whose count changes at run time, without
+ * allocating while the game runs.
+ *
+ * PagePool    - one block of fixed size pages, allocated up front and shared
+ *               by everything below. Thread safe. Also cuts pages into power
+ *               of 2 slices, for things much smaller than a page.
+ * PagedArray  - a growable array made of pages from a pool. Elements never
+ *               move when it grows, and an empty one holds no pages.
+ * SlotTable   - maps generational handles to a uint32 the owner picks, e.g.
+ *               where the thing currently sits in a dense array. A removed
+ *               slot gets a new generation, so old handles to it stop
+ *               matching instead of finding whatever reuses the slot.
+ */
+
+#ifndef MATAN_SLOTMAP_HH
+#define MATAN_SLOTMAP_HH
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace matan {
+  class PagePool {
+  public:
+    static constexpr std::size_t PAGE_BYTES = 4096;
+
+    explicit PagePool(std::size_t pages);
+    PagePool(const PagePool&) = delete;
+    PagePool& operator=(const PagePool&) = delete;
+    ~PagePool();
+    static constexpr std::size_t MIN_SLICE_BYTES = 512;
+
+    //nullptr once every page is out.
+    void* allocate();
+    void release(void* page);
+    /*
+     * bytes rounded up to a power of 2 of at least MIN_SLICE_BYTES, from a
+     * page cut into slices that size; a page past half a page. A page goes
+     * back to the pool once all its slices have. nullptr if it needs a page
+     * and every page is out.
+     */
+    void* allocateSlice(std::size_t bytes);
+    //bytes as it was allocated with.
+    void releaseSlice(void* slice, std::size_t bytes);
+    std::size_t pages() const { return m_pages; };
+    //Whole pages, not counting free slices.
+    std::size_t available();
+
+  private:
+    //Slices of MIN_SLICE_BYTES << c, up to half a page.
+    static constexpr int SLICE_CLASSES = 3;
+    static_assert(MIN_SLICE_BYTES << SLICE_CLASSES == PAGE_BYTES,
+                  "PagePool: slice classes must end at half a page");
+
+    //A free slice, in its class's list.
+    struct FreeSlice {
+      FreeSlice* prev;
+      FreeSlice* next;
+    };
+
+    const std::size_t m_pages;
+    unsigned char* m_memory;
+    std::mutex m_mutex;
+    std::vector<void*> m_free;
+    std::array<FreeSlice*, SLICE_CLASSES> m_slices{};
+    std::vector<std::uint16_t> m_slicesOut;  //per page, while it's cut up
+
+    static int sliceClass(std::size_t bytes);
+    std::size_t pageOf(const void* slice) const {
+      return (static_cast<const unsigned char*>(slice) - m_memory) / PAGE_BYTES;
+    };
+    void pushSlice(int c, void* slice);
+    void unlinkSlice(int c, FreeSlice* slice);
+  };
+
+  inline PagePool::PagePool(std::size_t pages) :
+      m_pages(pages),
+      m_memory(static_cast<unsigned char*>(
+          ::operator new(pages * PAGE_BYTES, std::align_val_t(PAGE_BYTES)))),
+      m_slicesOut(pages, 0) {
+    m_free.reserve(pages);
+    //Backwards, so the first pages handed out are the first in memory.
+    for (std::size_t i = pages; i > 0; --i) {
+      m_free.push_back(m_memory + (i - 1) * PAGE_BYTES);
+    }
+  }
+
+  inline PagePool::~PagePool() {
+    ::operator delete(m_memory, std::align_val_t(PAGE_BYTES));
+  }
+
+  inline void* PagePool::allocate() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_free.empty()) {
+      return nullptr;
+    }
+    void* page = m_free.back();
+    m_free.pop_back();
+    return page;
+  }
+
+  inline void PagePool::release(void* page) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_free.push_back(page);
+  }
+
+  inline int PagePool::sliceClass(std::size_t bytes) {
+    int c = 0;
+    while ((MIN_SLICE_BYTES << c) < bytes) {
+      ++c;
+    }
+    return c;
+  }
+
+  inline void PagePool::pushSlice(int c, void* slice) {
+    FreeSlice* s = static_cast<FreeSlice*>(slice);
+    s->prev = nullptr;
+    s->next = m_slices[c];
+    if (s->next) {
+      s->next->prev = s;
+    }
+    m_slices[c] = s;
+  }
+
+  inline void PagePool::unlinkSlice(int c, FreeSlice* slice) {
+    (slice->prev ? slice->prev->next : m_slices[c]) = slice->next;
+    if (slice->next) {
+      slice->next->prev = slice->prev;
+    }
+  }
+
+  inline void* PagePool::allocateSlice(std::size_t bytes) {
+    if (bytes > PAGE_BYTES / 2) {
+      return allocate();
+    }
+    const int c = sliceClass(bytes);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_slices[c]) {
+      if (m_free.empty()) {
+        return nullptr;
+      }
+      unsigned char* page = static_cast<unsigned char*>(m_free.back());
+      m_free.pop_back();
+      for (std::size_t offset = 0; offset < PAGE_BYTES; offset += MIN_SLICE_BYTES << c) {
+        pushSlice(c, page + offset);
+      }
+    }
+    FreeSlice* slice = m_slices[c];
+    unlinkSlice(c, slice);
+    ++m_slicesOut[pageOf(slice)];
+    return slice;
+  }
+
+  inline void PagePool::releaseSlice(void* slice, std::size_t bytes) {
+    if (bytes > PAGE_BYTES / 2) {
+      release(slice);
+      return;
+    }
+    const int c = sliceClass(bytes);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    pushSlice(c, slice);
+    const std::size_t p = pageOf(slice);
+    if (--m_slicesOut[p] == 0) {
+      //Every slice of the page is free: take them out of the list, give the page back.
+      unsigned char* page = m_memory + p * PAGE_BYTES;
+      for (std::size_t offset = 0; offset < PAGE_BYTES; offset += MIN_SLICE_BYTES << c) {
+        unlinkSlice(c, reinterpret_cast<FreeSlice*>(page + offset));
+      }
+      m_free.push_back(page);
+    }
+  }
+
+  inline std::size_t PagePool::available() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_free.size();
+  }
+
+  /*
+   * At most MAX_PAGES pages of PER_PAGE elements. T must be trivially
+   * copyable; elements past size() are left uninitialized.
+   */
+  template<class T, int MAX_PAGES>
+  class PagedArray {
+  public:
+    static constexpr int PER_PAGE = PagePool::PAGE_BYTES / sizeof(T);
+    static constexpr int CAPACITY = PER_PAGE * MAX_PAGES;
+    static_assert((PER_PAGE & (PER_PAGE - 1)) == 0,
+                  "PagedArray: sizeof(T) must divide the page into a power of 2");
+
+    explicit PagedArray(PagePool& pool) : m_pool(pool), m_pageCount(0), m_size(0) {}
+    PagedArray(const PagedArray&) = delete;
+    PagedArray& operator=(const PagedArray&) = delete;
+    ~PagedArray() { clear(); }
+
+    int size() const { return m_size; };
+    T& operator[](int i) { return m_pages[i / PER_PAGE][i % PER_PAGE]; };
+    const T& operator[](int i) const { return m_pages[i / PER_PAGE][i % PER_PAGE]; };
+    //false, and nothing changes, if it needs a page it can't get.
+    bool push_back(const T& value);
+    void pop_back();
+    //Grows or shrinks to n elements, false if it can't get the pages.
+    bool resize(int n);
+    //Gives every page back.
+    void clear();
+    //Same elements as other, a page at a time. false if it can't get the pages.
+    bool copyFrom(const PagedArray& other);
+
+    //For kernels that want plain arrays: page p holds pageSize(p) elements.
+    int pageCount() const { return (m_size + PER_PAGE - 1) / PER_PAGE; };
+    T* page(int p) { return m_pages[p]; };
+    const T* page(int p) const { return m_pages[p]; };
+    int pageSize(int p) const { return std::min(PER_PAGE, m_size - p * PER_PAGE); };
+
+  private:
+    PagePool& m_pool;
+    std::array<T*, MAX_PAGES> m_pages;
+    int m_pageCount;  //pages held, one more than needed is kept as a spare
+    int m_size;
+
+    bool reserve(int pages);
+    void trim();
+  };
+
+  template<class T, int MAX_PAGES>
+  bool PagedArray<T, MAX_PAGES>::reserve(int pages) {
+    if (pages > MAX_PAGES) {
+      return false;
+    }
+    while (m_pageCount < pages) {
+      void* page = m_pool.allocate();
+      if (!page) {
+        return false;
+      }
+      m_pages[m_pageCount++] = static_cast<T*>(page);
+    }
+    return true;
+  }
+
+  template<class T, int MAX_PAGES>
+  void PagedArray<T, MAX_PAGES>::trim() {
+    //Keep a spare, so hovering at a page boundary doesn't churn the pool.
+    while (m_pageCount > pageCount() + 1) {
+      m_pool.release(m_pages[--m_pageCount]);
+    }
+  }
+
+  template<class T, int MAX_PAGES>
+  bool PagedArray<T, MAX_PAGES>::push_back(const T& value) {
+    if (!reserve(m_size / PER_PAGE + 1)) {
+      return false;
+    }
+    (*this)[m_size++] = value;
+    return true;
+  }
+
+  template<class T, int MAX_PAGES>
+  void PagedArray<T, MAX_PAGES>::pop_back() {
+    --m_size;
+    trim();
+  }
+
+  template<class T, int MAX_PAGES>
+  bool PagedArray<T, MAX_PAGES>::resize(int n) {
+    if (!reserve((n + PER_PAGE - 1) / PER_PAGE)) {
+      return false;
+    }
+    m_size = n;
+    trim();
+    return true;
+  }
+
+  template<class T, int MAX_PAGES>
+  void PagedArray<T, MAX_PAGES>::clear() {
+    m_size = 0;
+    while (m_pageCount > 0) {
+      m_pool.release(m_pages[--m_pageCount]);
+    }
+  }
+
+  template<class T, int MAX_PAGES>
+  bool PagedArray<T, MAX_PAGES>::copyFrom(const PagedArray& other) {
+    if (!resize(other.size())) {
+      return false;
+    }
+    for (int p = 0; p < pageCount(); ++p) {
+      std::memcpy(m_pages[p], other.m_pages[p], pageSize(p) * sizeof(T));
+    }
+    return true;
+  }
+
+  struct SlotHandle {
+    std::uint32_t slot;
+    std::uint32_t generation;
+  };
+
+  template<int MAX_PAGES>
+  class SlotTable {
+  public:
+    explicit SlotTable(PagePool& pool) : m_slots(pool), m_freeHead(NONE), m_live(0) {}
+    int size() const { return m_live; };
+    //false if it's out of pages.
+    bool insert(std::uint32_t value, SlotHandle& handle);
+    //false if handle was already stale.
+    bool erase(SlotHandle handle);
+    bool contains(SlotHandle handle) const;
+    //value of a live handle, for the owner to read or update.
+    std::uint32_t& value(std::uint32_t slot) { return m_slots[slot].value; };
+    std::uint32_t value(std::uint32_t slot) const { return m_slots[slot].value; };
+    SlotHandle handle(std::uint32_t slot) const { return {slot, m_slots[slot].generation}; };
+    //Frees every slot. Their pages stay, so old handles keep failing.
+    void clear();
+    /*
+     * The same slots, values and free list as other, false if it can't get
+     * the pages. Generations are new, so other's handles don't work here.
+     */
+    bool copyFrom(const SlotTable& other);
+
+  private:
+    static constexpr std::uint32_t NONE = 0xffffffff;
+
+    //Odd generations are live. A free slot's value is the next free slot.
+    struct Slot {
+      std::uint32_t generation;
+      std::uint32_t value;
+    };
+
+    PagedArray<Slot, MAX_PAGES> m_slots;
+    std::uint32_t m_freeHead;
+    int m_live;
+    /*
+     * Where new slots start counting. Shared by every table, so a handle
+     * into a table that has since been destroyed and rebuilt doesn't match
+     * the slot that took its place either.
+     */
+    static inline std::atomic<std::uint32_t> s_nextGeneration{0};
+  };
+
+  template<int MAX_PAGES>
+  bool SlotTable<MAX_PAGES>::insert(std::uint32_t value, SlotHandle& handle) {
+    std::uint32_t slot = m_freeHead;
+    if (slot != NONE) {
+      m_freeHead = m_slots[slot].value;
+    } else {
+      slot = m_slots.size();
+      if (!m_slots.push_back({s_nextGeneration.fetch_add(2) & ~1u, 0})) {
+        return false;
+      }
+    }
+    Slot& s = m_slots[slot];
+    ++s.generation;
+    s.value = value;
+    ++m_live;
+    handle = {slot, s.generation};
+    return true;
+  }
+
+  template<int MAX_PAGES>
+  bool SlotTable<MAX_PAGES>::contains(SlotHandle handle) const {
+    return handle.slot < (std::uint32_t)m_slots.size() &&
+           m_slots[handle.slot].generation == handle.generation &&
+           (handle.generation & 1);
+  }
+
+  template<int MAX_PAGES>
+  bool SlotTable<MAX_PAGES>::erase(SlotHandle handle) {
+    if (!contains(handle)) {
+      return false;
+    }
+    Slot& s = m_slots[handle.slot];
+    ++s.generation;
+    s.value = m_freeHead;
+    m_freeHead = handle.slot;
+    --m_live;
+    return true;
+  }
+
+  template<int MAX_PAGES>
+  void SlotTable<MAX_PAGES>::clear() {
+    for (int slot = 0; slot < m_slots.size(); ++slot) {
+      if (m_slots[slot].generation & 1) {
+        erase(handle(slot));
+      }
+    }
+  }
+
+  template<int MAX_PAGES>
+  bool SlotTable<MAX_PAGES>::copyFrom(const SlotTable& other) {
+    if (!m_slots.copyFrom(other.m_slots)) {
+      return false;
+    }
+    //One block of fresh generations for the lot, keeping which are live.
+    const std::uint32_t first = s_nextGeneration.fetch_add(2 * m_slots.size()) & ~1u;
+    for (int slot = 0; slot < m_slots.size(); ++slot) {
+      std::uint32_t& generation = m_slots[slot].generation;
+      generation = (first + 2 * slot) | (generation & 1);
+    }
+    m_freeHead = other.m_freeHead;
+    m_live = other.m_live;
+    return true;
+  }
+} //namespace matan
+
+#endif //MATAN_SLOTMAP_HH
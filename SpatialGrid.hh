@@ -0,0 +1,289 @@
+/*
+ * Uniform grid over a set of points for radius, box and k-nearest queries.
+ *
+ * Space is cut into cubes of cellSize and each cube hashes to one of a fixed
+ * number of buckets, so the grid covers unbounded coordinates in fixed
+ * memory. build() counting sorts the points by bucket into one array, which
+ * is O(n) and leaves every bucket contiguous. There are no incremental
+ * updates: every entity moves every tick, so patching the grid would still
+ * rewrite every entry, and separate buckets make queries slower.
+ * BenchSpatialGrid.cc measures both. A query visits the cells it overlaps
+ * and only looks at the points of their buckets, skipping points that share
+ * the bucket but not the cell.
+ *
+ * The bucket table is fixed at compile time. The points go in Storage, a
+ * std::vector by default; anything with size(), operator[] and a resize(n)
+ * that either returns nothing or returns false when it can't will do, such
+ * as a PagedArray. Queries are const and may run concurrently with each
+ * other, not with build().
+ */
+
+#ifndef MATAN_SPATIALGRID_HH
+#define MATAN_SPATIALGRID_HH
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace matan {
+  struct GridEntry {
+    float x, y, z;
+    std::uint32_t id;
+  };
+
+  //BUCKETS must be a power of 2.
+  template<int BUCKETS, class Storage = std::vector<GridEntry>>
+  class SpatialGrid {
+  public:
+    static_assert((BUCKETS & (BUCKETS - 1)) == 0, "SpatialGrid: BUCKETS must be a power of 2");
+    typedef GridEntry Entry;
+
+    //storageArgs go to Storage's constructor.
+    template<class... Args>
+    explicit SpatialGrid(float cellSize, Args&&... storageArgs);
+    int size() const { return m_size; };
+    /*
+     * forEachPoint(emit) must call emit(entry) once per point, and do the
+     * same thing both times build calls it. If Storage can't hold them all
+     * the grid is left empty and build returns false.
+     */
+    template<class F> bool build(F&& forEachPoint);
+    //f(entry) for every point within radius of (x, y, z).
+    template<class F>
+    void forEachInRadius(float x, float y, float z, float radius, F&& f) const;
+    //f(entry) for every point in the box, bounds included.
+    template<class F>
+    void forEachInBox(float minX, float minY, float minZ,
+                      float maxX, float maxY, float maxZ, F&& f) const;
+    /*
+     * Up to k points closest to (x, y, z), nearest first, into out, which
+     * must have room for k. Returns how many it found.
+     */
+    int nearest(float x, float y, float z, int k, Entry* out) const;
+
+  private:
+    static constexpr std::uint32_t MASK = BUCKETS - 1;
+    float m_cellSize;
+    float m_inverseCell;
+    std::array<int, BUCKETS + 1> m_start;  //bucket b is m_entries[m_start[b], m_start[b + 1])
+    Storage m_entries;
+    int m_size;
+    float m_min[3];                 //bounds of all the points
+    float m_max[3];
+
+    int cell(float v) const;
+    std::uint32_t bucket(int cx, int cy, int cz) const;
+    std::uint32_t bucketOf(const Entry& e) const;
+    template<class F>
+    void forEachInCells(float minX, float minY, float minZ,
+                        float maxX, float maxY, float maxZ, F&& f) const;
+    bool resizeStorage(int n);
+  };
+
+  template<int BUCKETS, class Storage>
+  template<class... Args>
+  SpatialGrid<BUCKETS, Storage>::SpatialGrid(float cellSize, Args&&... storageArgs) :
+      m_cellSize(cellSize),
+      m_inverseCell(1.0f / cellSize),
+      m_start{},
+      m_entries(std::forward<Args>(storageArgs)...),
+      m_size(0),
+      m_min{0, 0, 0},
+      m_max{0, 0, 0} {}
+
+  template<int BUCKETS, class Storage>
+  int SpatialGrid<BUCKETS, Storage>::cell(float v) const {
+    //floor without the libm call std::floor is on plain x86-64.
+    const float scaled = v * m_inverseCell;
+    const int truncated = (int)scaled;
+    return truncated - (scaled < truncated);
+  }
+
+  template<int BUCKETS, class Storage>
+  std::uint32_t SpatialGrid<BUCKETS, Storage>::bucket(int cx, int cy, int cz) const {
+    //Teschner et al., "Optimized Spatial Hashing for Collision Detection".
+    return ((std::uint32_t)cx * 73856093u ^
+            (std::uint32_t)cy * 19349663u ^
+            (std::uint32_t)cz * 83492791u) & MASK;
+  }
+
+  template<int BUCKETS, class Storage>
+  std::uint32_t SpatialGrid<BUCKETS, Storage>::bucketOf(const Entry& e) const {
+    return bucket(cell(e.x), cell(e.y), cell(e.z));
+  }
+
+  template<int BUCKETS, class Storage>
+  bool SpatialGrid<BUCKETS, Storage>::resizeStorage(int n) {
+    if constexpr (std::is_void<decltype(m_entries.resize(n))>::value) {
+      m_entries.resize(n);
+      return true;
+    } else {
+      return m_entries.resize(n);
+    }
+  }
+
+  template<int BUCKETS, class Storage>
+  template<class F>
+  bool SpatialGrid<BUCKETS, Storage>::build(F&& forEachPoint) {
+    //Count, prefix sum, then place, using m_start[b] as b's cursor.
+    std::fill(m_start.begin(), m_start.end(), 0);
+    //Bounds in locals, the compiler can't keep members in registers
+    //across the stores to m_start.
+    float minX = std::numeric_limits<float>::max(), minY = minX, minZ = minX;
+    float maxX = std::numeric_limits<float>::lowest(), maxY = maxX, maxZ = maxX;
+    int n = 0;
+    forEachPoint([&](const Entry& e) {
+      ++m_start[bucketOf(e) + 1];
+      ++n;
+      minX = std::min(minX, e.x);
+      minY = std::min(minY, e.y);
+      minZ = std::min(minZ, e.z);
+      maxX = std::max(maxX, e.x);
+      maxY = std::max(maxY, e.y);
+      maxZ = std::max(maxZ, e.z);
+    });
+    if (!resizeStorage(n)) {
+      m_size = 0;
+      return false;
+    }
+    m_size = n;
+    m_min[0] = minX, m_min[1] = minY, m_min[2] = minZ;
+    m_max[0] = maxX, m_max[1] = maxY, m_max[2] = maxZ;
+    for (std::size_t b = 1; b < m_start.size(); ++b) {
+      m_start[b] += m_start[b - 1];
+    }
+
+    forEachPoint([this](const Entry& e) {
+      m_entries[m_start[bucketOf(e)]++] = e;
+    });
+    //Every cursor now sits at the start of the next bucket; shift back.
+    for (std::size_t b = m_start.size() - 1; b > 0; --b) {
+      m_start[b] = m_start[b - 1];
+    }
+    m_start[0] = 0;
+    return true;
+  }
+
+  template<int BUCKETS, class Storage>
+  template<class F>
+  void SpatialGrid<BUCKETS, Storage>::forEachInCells(float minX, float minY, float minZ,
+                                   float maxX, float maxY, float maxZ, F&& f) const {
+    if (m_size == 0) {
+      return;
+    }
+    //Clip to the points' bounds, the cells outside them are empty anyway.
+    minX = std::max(minX, m_min[0]);
+    minY = std::max(minY, m_min[1]);
+    minZ = std::max(minZ, m_min[2]);
+    maxX = std::min(maxX, m_max[0]);
+    maxY = std::min(maxY, m_max[1]);
+    maxZ = std::min(maxZ, m_max[2]);
+    if (minX > maxX || minY > maxY || minZ > maxZ) {
+      return;
+    }
+    const int x0 = cell(minX), x1 = cell(maxX);
+    const int y0 = cell(minY), y1 = cell(maxY);
+    const int z0 = cell(minZ), z1 = cell(maxZ);
+    const double cells = (double)(x1 - x0 + 1) * (y1 - y0 + 1) * (z1 - z0 + 1);
+    if (cells > BUCKETS) {
+      //More cells than buckets, one pass over everything is cheaper.
+      for (int i = 0; i < m_size; ++i) {
+        f(m_entries[i]);
+      }
+      return;
+    }
+    for (int cx = x0; cx <= x1; ++cx) {
+      for (int cy = y0; cy <= y1; ++cy) {
+        for (int cz = z0; cz <= z1; ++cz) {
+          const std::uint32_t b = bucket(cx, cy, cz);
+          for (int i = m_start[b]; i < m_start[b + 1]; ++i) {
+            const Entry& e = m_entries[i];
+            //Other cells hash here too.
+            if (cell(e.x) == cx && cell(e.y) == cy && cell(e.z) == cz) {
+              f(e);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  template<int BUCKETS, class Storage>
+  template<class F>
+  void SpatialGrid<BUCKETS, Storage>::forEachInRadius(float x, float y, float z, float radius,
+                                    F&& f) const {
+    const float r2 = radius * radius;
+    forEachInCells(x - radius, y - radius, z - radius,
+                   x + radius, y + radius, z + radius,
+                   [x, y, z, r2, &f](const Entry& e) {
+      const float dx = e.x - x, dy = e.y - y, dz = e.z - z;
+      if (dx*dx + dy*dy + dz*dz <= r2) {
+        f(e);
+      }
+    });
+  }
+
+  template<int BUCKETS, class Storage>
+  template<class F>
+  void SpatialGrid<BUCKETS, Storage>::forEachInBox(float minX, float minY, float minZ,
+                                 float maxX, float maxY, float maxZ, F&& f) const {
+    forEachInCells(minX, minY, minZ, maxX, maxY, maxZ, [&](const Entry& e) {
+      if (e.x >= minX && e.x <= maxX && e.y >= minY && e.y <= maxY &&
+          e.z >= minZ && e.z <= maxZ) {
+        f(e);
+      }
+    });
+  }
+
+  template<int BUCKETS, class Storage>
+  int SpatialGrid<BUCKETS, Storage>::nearest(float x, float y, float z, int k,
+                                              Entry* out) const {
+    if (k <= 0 || m_size == 0) {
+      return 0;
+    }
+    auto distance2 = [x, y, z](const Entry& e) {
+      const float dx = e.x - x, dy = e.y - y, dz = e.z - z;
+      return dx*dx + dy*dy + dz*dz;
+    };
+    auto farther = [&distance2](const Entry& a, const Entry& b) {
+      return distance2(a) < distance2(b);
+    };
+    //Far enough from (x, y, z) to reach every point.
+    float reach = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+      const float p = axis == 0 ? x : axis == 1 ? y : z;
+      reach = std::max(reach, std::max(std::fabs(p - m_min[axis]),
+                                       std::fabs(p - m_max[axis])));
+    }
+    reach *= std::sqrt(3.0f);
+
+    //Grow the radius until it holds k points, or everything.
+    int found = 0;
+    for (float radius = m_cellSize; ; radius *= 2) {
+      //out[0, found) is a max heap on distance.
+      found = 0;
+      forEachInRadius(x, y, z, radius, [&](const Entry& e) {
+        if (found < k) {
+          out[found++] = e;
+          std::push_heap(out, out + found, farther);
+        } else if (distance2(e) < distance2(out[0])) {
+          std::pop_heap(out, out + found, farther);
+          out[found - 1] = e;
+          std::push_heap(out, out + found, farther);
+        }
+      });
+      if (found == k || radius >= reach) {
+        break;
+      }
+    }
+    std::sort_heap(out, out + found, farther);
+    return found;
+  }
+} //namespace matan
+
+#endif //MATAN_SPATIALGRID_HH
@@ -0,0 +1,159 @@
+/*
+ * Task is a move only void() callable that keeps the callable inline, so
+ * submitting one never touches the allocator. Anything that doesn't fit in
+ * Task::CAPACITY bytes is a compile error rather than a hidden malloc;
+ * capture big objects by pointer or std::ref.
+ *
+ * TaskQueue is a growable ring of Tasks. It only allocates when it has to
+ * grow past the most tasks it has ever held at once, unlike std::deque which
+ * frees and reallocates blocks as tasks flow through it.
+ *
+ * With MATAN_THREADPOOL_STATS defined a Task also carries the time it was
+ * queued, for ThreadPool's latency figures.
+ */
+
+#ifndef MATAN_TASK_HH
+#define MATAN_TASK_HH
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#ifdef MATAN_THREADPOOL_STATS
+#include <chrono>
+#endif
+
+namespace matan {
+  class Task {
+  public:
+    static constexpr std::size_t CAPACITY = 48;
+
+    Task() : m_ops(nullptr) {}
+    template<class F,
+             class = typename std::enable_if<
+                 !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F&& f);
+    Task(Task&& other) noexcept;
+    Task& operator=(Task&& other) noexcept;
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { reset(); }
+
+    explicit operator bool() const { return m_ops != nullptr; }
+    void operator()() { m_ops->call(m_storage); }
+    void reset();
+
+#ifdef MATAN_THREADPOOL_STATS
+    std::chrono::steady_clock::time_point enqueued;
+#endif
+
+  private:
+    struct Ops {
+      void (*call)(void*);
+      void (*move)(void* dst, void* src);
+      void (*destroy)(void*);
+    };
+
+    template<class F>
+    struct OpsFor {
+      static void call(void* p) { (*static_cast<F*>(p))(); }
+      static void move(void* dst, void* src) {
+        ::new (dst) F(std::move(*static_cast<F*>(src)));
+        static_cast<F*>(src)->~F();
+      }
+      static void destroy(void* p) { static_cast<F*>(p)->~F(); }
+      static constexpr Ops ops = {call, move, destroy};
+    };
+
+    alignas(std::max_align_t) unsigned char m_storage[CAPACITY];
+    const Ops* m_ops;
+  };
+
+  template<class F>
+  constexpr Task::Ops Task::OpsFor<F>::ops;
+
+  template<class F, class>
+  Task::Task(F&& f) {
+    typedef typename std::decay<F>::type Fn;
+    static_assert(sizeof(Fn) <= CAPACITY,
+                  "Task: callable too big to store inline, capture by pointer or std::ref");
+    static_assert(alignof(Fn) <= alignof(std::max_align_t),
+                  "Task: callable is over aligned");
+    ::new (m_storage) Fn(std::forward<F>(f));
+    m_ops = &OpsFor<Fn>::ops;
+  }
+
+  inline Task::Task(Task&& other) noexcept : m_ops(other.m_ops) {
+#ifdef MATAN_THREADPOOL_STATS
+    enqueued = other.enqueued;
+#endif
+    if (m_ops) {
+      m_ops->move(m_storage, other.m_storage);
+      other.m_ops = nullptr;
+    }
+  }
+
+  inline Task& Task::operator=(Task&& other) noexcept {
+    if (this != &other) {
+      reset();
+      m_ops = other.m_ops;
+#ifdef MATAN_THREADPOOL_STATS
+      enqueued = other.enqueued;
+#endif
+      if (m_ops) {
+        m_ops->move(m_storage, other.m_storage);
+        other.m_ops = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  inline void Task::reset() {
+    if (m_ops) {
+      m_ops->destroy(m_storage);
+      m_ops = nullptr;
+    }
+  }
+
+  class TaskQueue {
+  public:
+    TaskQueue() : m_slots(64), m_head(0), m_tail(0) {}
+    bool empty() const { return m_head == m_tail; };
+    std::size_t size() const { return m_tail - m_head; };
+    void push_back(Task&& task);
+    Task pop_back();
+    Task pop_front();
+
+  private:
+    //Capacity is always a power of 2, m_head/m_tail only ever grow.
+    std::vector<Task> m_slots;
+    std::size_t m_head;
+    std::size_t m_tail;
+
+    Task& slot(std::size_t i) { return m_slots[i & (m_slots.size() - 1)]; }
+  };
+
+  inline void TaskQueue::push_back(Task&& task) {
+    if (size() == m_slots.size()) {
+      std::vector<Task> slots(m_slots.size() * 2);
+      for (std::size_t i = 0; i < size(); ++i) {
+        slots[i] = std::move(slot(m_head + i));
+      }
+      m_tail = size();
+      m_head = 0;
+      m_slots.swap(slots);
+    }
+    slot(m_tail++) = std::move(task);
+  }
+
+  inline Task TaskQueue::pop_back() {
+    return std::move(slot(--m_tail));
+  }
+
+  inline Task TaskQueue::pop_front() {
+    return std::move(slot(m_head++));
+  }
+} //namespace matan
+
+#endif //MATAN_TASK_HH
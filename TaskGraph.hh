@@ -0,0 +1,101 @@
+/*
+ * A DAG of tasks run on a ThreadPool. Build it once, then run() it as often
+ * as you like, e.g. once a frame; running only resets a counter per node.
+ *
+ * A node starts once every node that precedes it has finished, so nodes with
+ * no path between them run concurrently. When a node finishes, the worker
+ * carries straight on with one of the successors it made ready and queues
+ * the rest. The graph must be acyclic, which isn't checked.
+ */
+
+#ifndef MATAN_TASKGRAPH_HH
+#define MATAN_TASKGRAPH_HH
+
+#include <atomic>
+#include <vector>
+#include "ThreadPool.hh"
+#include "Task.hh"
+
+namespace matan {
+  class TaskGraph {
+  public:
+    typedef int Node;
+
+    TaskGraph() : m_done(0) {}
+    template<class F> Node add(F&& fn);
+    //after won't start until before has finished.
+    void precede(Node before, Node after);
+    int size() const { return m_nodes.size(); };
+    //Runs every node once and returns when they all have.
+    void run(ThreadPool& pool);
+
+  private:
+    struct NodeData {
+      Task fn;
+      std::vector<Node> successors;
+      int dependencies;
+    };
+
+    std::vector<NodeData> m_nodes;
+    std::vector<std::atomic_int> m_pending;
+    Latch m_done;
+
+    void runNode(ThreadPool& pool, Node node);
+  };
+
+  template<class F>
+  TaskGraph::Node TaskGraph::add(F&& fn) {
+    m_nodes.push_back({Task(std::forward<F>(fn)), {}, 0});
+    return m_nodes.size() - 1;
+  }
+
+  inline void TaskGraph::precede(Node before, Node after) {
+    m_nodes[before].successors.push_back(after);
+    ++m_nodes[after].dependencies;
+  }
+
+  inline void TaskGraph::run(ThreadPool& pool) {
+    if (m_nodes.empty()) {
+      return;
+    }
+    if (m_pending.size() != m_nodes.size()) {
+      m_pending = std::vector<std::atomic_int>(m_nodes.size());
+    }
+    const Node count = size();
+    for (Node i = 0; i < count; ++i) {
+      m_pending[i] = m_nodes[i].dependencies;
+    }
+    m_done.reset(m_nodes.size());
+
+    for (Node i = 0; i < count; ++i) {
+      if (m_nodes[i].dependencies == 0) {
+        pool.enqueue([this, &pool, i]() { runNode(pool, i); });
+      }
+    }
+    pool.wait(m_done);
+  }
+
+  inline void TaskGraph::runNode(ThreadPool& pool, Node node) {
+    while (node >= 0) {
+      NodeData& data = m_nodes[node];
+      data.fn();
+
+      Node next = -1;
+      for (Node successor : data.successors) {
+        if (--m_pending[successor] != 0) {
+          continue;
+        }
+        if (next < 0) {
+          next = successor;
+        } else {
+          pool.enqueue([this, &pool, successor]() { runNode(pool, successor); });
+        }
+      }
+      //Only after the successors are out, so m_done can't open early.
+      m_done.countDown();
+      node = next;
+    }
+  }
+} //namespace matan
+
+#endif //MATAN_TASKGRAPH_HH
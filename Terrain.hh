@@ -0,0 +1,377 @@
+/*
+ * Seeded terrain for a chunk: a heightmap from 2D fractal noise, soil and
+ * stone under it, water up to SEA_LEVEL over it, and caves carved out of
+ * the ground by 3D fractal noise.
+ *
+ * The noise is gradient noise (Perlin's improved noise) with the lattice
+ * gradients picked by an integer hash of the corner and the seed, not a
+ * permutation table, so there are no lookups and a lane per point
+ * vectorizes. gradientNoise() is the scalar reference. The kernels add
+ * amplitude * noise over a row of points along x, and every chunk is
+ * evaluated a row of WIDTH blocks at a time: down each column for the
+ * caves, across them for the heightmap.
+ *
+ * The SSE2, AVX2 and AVX-512 kernels are one body written with GCC vector
+ * types, 4, 8 and 16 lanes wide, compiled under each target attribute like
+ * the kernels in EntityKernels.hh. They do the scalar reference's
+ * arithmetic in the same order and give its result to the bit;
+ * BenchTerrain.cc checks that, and times each one.
+ */
+
+#ifndef MATAN_TERRAIN_HH
+#define MATAN_TERRAIN_HH
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "EntityKernels.hh"
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+namespace matan {
+  //out[i] += amplitude * gradientNoise(seed, x + i * step, y, z) for i in [0, n).
+  typedef void (*NoiseRowFn)(std::uint32_t seed, float x, float step, float y, float z,
+                             float amplitude, float* out, int n);
+
+  namespace noise {
+    //Multiplied into each lattice coordinate before hashing.
+    constexpr std::uint32_t PRIME_X = 0x8da6b343u;
+    constexpr std::uint32_t PRIME_Y = 0xd8163841u;
+    constexpr std::uint32_t PRIME_Z = 0xcb1ab31fu;
+
+    inline std::uint32_t mix(std::uint32_t h) {
+      h ^= h >> 16;
+      h *= 0x7feb352du;
+      h ^= h >> 15;
+      h *= 0x846ca68bu;
+      h ^= h >> 16;
+      return h;
+    }
+
+    //Perlin's 12 edge gradients (and 4 repeats), from the top 4 bits of h.
+    inline float gradient(std::uint32_t h, float x, float y, float z) {
+      h >>= 28;
+      const float u = h < 8 ? x : y;
+      const float v = h < 4 ? y : (h == 12 || h == 14 ? x : z);
+      return ((h & 1) ? -u : u) + ((h & 2) ? -v : v);
+    }
+
+    inline float fade(float t) {
+      return t * t * t * (t * (t * 6.0f - 15.0f) + 10.0f);
+    }
+
+    inline float lerp(float t, float a, float b) {
+      return a + t * (b - a);
+    }
+
+    //floor, as SpatialGrid::cell does it.
+    inline int floorInt(float v) {
+      const int truncated = (int)v;
+      return truncated - (v < truncated);
+    }
+  } //namespace noise
+
+  //Gradient noise at (x, y, z), roughly in [-1, 1]. The scalar reference.
+  inline float gradientNoise(std::uint32_t seed, float x, float y, float z) {
+    using namespace noise;
+    const int ix = floorInt(x), iy = floorInt(y), iz = floorInt(z);
+    const float fx = x - (float)ix, fy = y - (float)iy, fz = z - (float)iz;
+    const std::uint32_t x0 = (std::uint32_t)ix * PRIME_X, x1 = x0 + PRIME_X;
+    const std::uint32_t y0 = (std::uint32_t)iy * PRIME_Y, y1 = y0 + PRIME_Y;
+    const std::uint32_t z0 = (std::uint32_t)iz * PRIME_Z, z1 = z0 + PRIME_Z;
+    const float gx = fx - 1.0f, gy = fy - 1.0f, gz = fz - 1.0f;
+    const float n000 = gradient(mix(x0 ^ y0 ^ z0 ^ seed), fx, fy, fz);
+    const float n100 = gradient(mix(x1 ^ y0 ^ z0 ^ seed), gx, fy, fz);
+    const float n010 = gradient(mix(x0 ^ y1 ^ z0 ^ seed), fx, gy, fz);
+    const float n110 = gradient(mix(x1 ^ y1 ^ z0 ^ seed), gx, gy, fz);
+    const float n001 = gradient(mix(x0 ^ y0 ^ z1 ^ seed), fx, fy, gz);
+    const float n101 = gradient(mix(x1 ^ y0 ^ z1 ^ seed), gx, fy, gz);
+    const float n011 = gradient(mix(x0 ^ y1 ^ z1 ^ seed), fx, gy, gz);
+    const float n111 = gradient(mix(x1 ^ y1 ^ z1 ^ seed), gx, gy, gz);
+    const float u = fade(fx), v = fade(fy), w = fade(fz);
+    return lerp(w, lerp(v, lerp(u, n000, n100), lerp(u, n010, n110)),
+                   lerp(v, lerp(u, n001, n101), lerp(u, n011, n111)));
+  }
+
+  namespace kernels {
+    inline void noiseRowScalar(std::uint32_t seed, float x, float step, float y, float z,
+                               float amplitude, float* out, int n) {
+      MATAN_NO_CONTRACT
+      for (int i = 0; i < n; ++i) {
+        out[i] = out[i] + amplitude * gradientNoise(seed, x + (float)i * step, y, z);
+      }
+    }
+
+#ifdef MATAN_KERNELS_X86
+    template<int W>
+    struct LaneTypes {
+      typedef float F __attribute__((vector_size(W * 4)));
+      typedef std::int32_t I __attribute__((vector_size(W * 4)));
+      typedef std::uint32_t U __attribute__((vector_size(W * 4)));
+    };
+
+    /*
+     * W lanes of gradientNoise, step for step. Vectors only go by
+     * reference: GCC warns about any function that takes or returns one by
+     * value without the target enabled, even one that's always inlined.
+     */
+    template<int W>
+    struct NoiseLanes {
+      //Through LaneTypes, GCC sizes a vector member typedef before W is known.
+      typedef typename LaneTypes<W>::F F;
+      typedef typename LaneTypes<W>::I I;
+      typedef typename LaneTypes<W>::U U;
+
+      //out = gradient(mix(hash), x, y, z)
+      __attribute__((always_inline))
+      static void corner(const U& hash, const F& x, const F& y, const F& z, F& out) {
+        U h = hash;
+        h ^= h >> 16;
+        h *= 0x7feb352du;
+        h ^= h >> 15;
+        h *= 0x846ca68bu;
+        h ^= h >> 16;
+        h >>= 28;
+        const F u = h < 8 ? x : y;
+        //h is 12 or 14. GCC does || of two masks, or |, a lane at a time.
+        const F v = h < 4 ? y : ((h | 2) == 14 ? x : z);
+        out = ((h & 1) != 0 ? -u : u) + ((h & 2) != 0 ? -v : v);
+      }
+
+      //floor(v), and v less that.
+      __attribute__((always_inline))
+      static void split(const F& v, U& cell, F& fraction) {
+        const I truncated = __builtin_convertvector(v, I);
+        const I floor = v < __builtin_convertvector(truncated, F) ? truncated - 1 : truncated;
+        cell = (U)floor;
+        fraction = v - __builtin_convertvector(floor, F);
+      }
+
+      __attribute__((always_inline))
+      static void noise(std::uint32_t seed, const F& x, const F& y, const F& z, F& out) {
+        U ix, iy, iz;
+        F fx, fy, fz;
+        split(x, ix, fx);
+        split(y, iy, fy);
+        split(z, iz, fz);
+        const U x0 = ix * noise::PRIME_X, x1 = x0 + noise::PRIME_X;
+        const U y0 = iy * noise::PRIME_Y, y1 = y0 + noise::PRIME_Y;
+        const U z0 = iz * noise::PRIME_Z, z1 = z0 + noise::PRIME_Z;
+        const F gx = fx - 1.0f, gy = fy - 1.0f, gz = fz - 1.0f;
+        F n000, n100, n010, n110, n001, n101, n011, n111;
+        corner(x0 ^ y0 ^ z0 ^ seed, fx, fy, fz, n000);
+        corner(x1 ^ y0 ^ z0 ^ seed, gx, fy, fz, n100);
+        corner(x0 ^ y1 ^ z0 ^ seed, fx, gy, fz, n010);
+        corner(x1 ^ y1 ^ z0 ^ seed, gx, gy, fz, n110);
+        corner(x0 ^ y0 ^ z1 ^ seed, fx, fy, gz, n001);
+        corner(x1 ^ y0 ^ z1 ^ seed, gx, fy, gz, n101);
+        corner(x0 ^ y1 ^ z1 ^ seed, fx, gy, gz, n011);
+        corner(x1 ^ y1 ^ z1 ^ seed, gx, gy, gz, n111);
+        //fade and lerp written out, as noise:: has them.
+        const F u = fx * fx * fx * (fx * (fx * 6.0f - 15.0f) + 10.0f);
+        const F v = fy * fy * fy * (fy * (fy * 6.0f - 15.0f) + 10.0f);
+        const F w = fz * fz * fz * (fz * (fz * 6.0f - 15.0f) + 10.0f);
+        const F x00 = n000 + u * (n100 - n000), x10 = n010 + u * (n110 - n010);
+        const F x01 = n001 + u * (n101 - n001), x11 = n011 + u * (n111 - n011);
+        const F y0s = x00 + v * (x10 - x00), y1s = x01 + v * (x11 - x01);
+        out = y0s + w * (y1s - y0s);
+      }
+
+      __attribute__((always_inline))
+      static void row(std::uint32_t seed, float x, float step, float y, float z,
+                      float amplitude, float* out, int n) {
+        F lane;
+        for (int l = 0; l < W; ++l) {
+          lane[l] = (float)l;
+        }
+        const F ys = F{} + y, zs = F{} + z;
+        int i = 0;
+        for (; i + W <= n; i += W) {
+          const F xs = x + ((float)i + lane) * step;
+          F sum;
+          std::memcpy(&sum, out + i, sizeof(sum));
+          F n;
+          noise(seed, xs, ys, zs, n);
+          sum = sum + amplitude * n;
+          std::memcpy(out + i, &sum, sizeof(sum));
+        }
+        //The tail in the same order, indices and all, as the reference.
+        for (; i < n; ++i) {
+          out[i] = out[i] + amplitude * gradientNoise(seed, x + (float)i * step, y, z);
+        }
+      }
+    };
+
+    __attribute__((target("sse2")))
+    inline void noiseRowSSE2(std::uint32_t seed, float x, float step, float y, float z,
+                             float amplitude, float* out, int n) {
+      NoiseLanes<4>::row(seed, x, step, y, z, amplitude, out, n);
+    }
+
+    __attribute__((target("avx2")))
+    inline void noiseRowAVX2(std::uint32_t seed, float x, float step, float y, float z,
+                             float amplitude, float* out, int n) {
+      NoiseLanes<8>::row(seed, x, step, y, z, amplitude, out, n);
+    }
+
+    __attribute__((target("avx512f")))
+    inline void noiseRowAVX512(std::uint32_t seed, float x, float step, float y, float z,
+                               float amplitude, float* out, int n) {
+      NoiseLanes<16>::row(seed, x, step, y, z, amplitude, out, n);
+    }
+#endif
+  } //namespace kernels
+
+  //The kernel for isa, or nullptr if it wasn't compiled in or can't run here.
+  inline NoiseRowFn noiseRowKernel(Isa isa) {
+    if (!isaSupported(isa)) {
+      return nullptr;
+    }
+    switch (isa) {
+#ifdef MATAN_KERNELS_X86
+      case Isa::SSE2: return kernels::noiseRowSSE2;
+      case Isa::AVX2: return kernels::noiseRowAVX2;
+      case Isa::AVX512: return kernels::noiseRowAVX512;
+#endif
+      default: return kernels::noiseRowScalar;
+    }
+  }
+
+  class Terrain {
+  public:
+    //A chunk is WIDTH x WIDTH columns of HEIGHT blocks, in sections of
+    //SECTION_HEIGHT, y outermost: block (x, y, z) is (y * WIDTH + z) * WIDTH + x.
+    static constexpr int WIDTH = 16;
+    static constexpr int HEIGHT = 256;
+    static constexpr int SECTION_HEIGHT = 16;
+    static constexpr int COLUMNS = WIDTH * WIDTH;
+    static constexpr int SECTION_BLOCKS = COLUMNS * SECTION_HEIGHT;
+    static constexpr int SECTION_COUNT = HEIGHT / SECTION_HEIGHT;
+    static constexpr int BLOCKS = COLUMNS * HEIGHT;
+
+    //The ids it places.
+    enum : unsigned char { AIR, STONE, DIRT, GRASS, SAND, WATER, BEDROCK };
+    static constexpr int SEA_LEVEL = 64;
+    static constexpr int BASE_HEIGHT = 68;
+    //Blocks the heightmap's noise is scaled by.
+    static constexpr float HEIGHT_RANGE = 40.0f;
+    static constexpr float HEIGHT_FREQUENCY = 1.0f / 128;
+    static constexpr int HEIGHT_OCTAVES = 4;
+    static constexpr float CAVE_FREQUENCY = 1.0f / 24;
+    static constexpr int CAVE_OCTAVES = 2;
+    //Ground where the cave noise is above this is hollow.
+    static constexpr float CAVE_THRESHOLD = 0.35f;
+    //Soil over the stone.
+    static constexpr int SOIL_DEPTH = 4;
+
+    explicit Terrain(std::uint32_t seed, Isa isa = bestIsa()) :
+        m_seed(seed), m_noise(noiseRowKernel(isa)) {
+      if (!m_noise) {
+        m_noise = kernels::noiseRowScalar;
+      }
+    }
+    std::uint32_t seed() const { return m_seed; };
+    //Surface height of each column of chunk cx, heights[z * WIDTH + x].
+    void heightmap(int cx, int* heights) const;
+    //Blocks of section s of chunk cx, in the chunk's order from the
+    //section's bottom. heights from heightmap().
+    void section(int cx, const int* heights, int s, unsigned char* out) const;
+    //Every section of chunk cx, out[BLOCKS].
+    void generate(int cx, unsigned char* out) const;
+
+  private:
+    static constexpr std::uint32_t CAVE_SALT = 0x63617665;  //"cave"
+
+    std::uint32_t m_seed;
+    NoiseRowFn m_noise;
+
+    //out[x] += fractal noise at (x0 + x, y, z) for x in [0, WIDTH), octaves
+    //each twice the frequency and half the amplitude of the last.
+    void fractalRow(std::uint32_t seed, float x0, float y, float z, float frequency,
+                    int octaves, float* out) const;
+  };
+
+  inline void Terrain::fractalRow(std::uint32_t seed, float x0, float y, float z,
+                                  float frequency, int octaves, float* out) const {
+    float amplitude = 1.0f;
+    for (int octave = 0; octave < octaves; ++octave) {
+      m_noise(seed + octave, x0 * frequency, frequency, y * frequency, z * frequency,
+              amplitude, out, WIDTH);
+      frequency *= 2.0f;
+      amplitude *= 0.5f;
+    }
+  }
+
+  inline void Terrain::heightmap(int cx, int* heights) const {
+    const float x0 = (float)(cx * WIDTH);
+    for (int z = 0; z < WIDTH; ++z) {
+      float row[WIDTH] = {};
+      fractalRow(m_seed, x0, 0.0f, (float)z, HEIGHT_FREQUENCY, HEIGHT_OCTAVES, row);
+      for (int x = 0; x < WIDTH; ++x) {
+        const int h = BASE_HEIGHT + (int)(row[x] * HEIGHT_RANGE);
+        heights[z * WIDTH + x] = std::clamp(h, 1, HEIGHT - 1);
+      }
+    }
+  }
+
+  inline void Terrain::section(int cx, const int* heights, int s, unsigned char* out) const {
+    const int bottom = s * SECTION_HEIGHT;
+    const int top = *std::max_element(heights, heights + COLUMNS);
+    if (bottom > top && bottom > SEA_LEVEL) {
+      std::memset(out, AIR, SECTION_BLOCKS);
+      return;
+    }
+    const float x0 = (float)(cx * WIDTH);
+    for (int z = 0; z < WIDTH; ++z) {
+      const int* rowHeights = heights + z * WIDTH;
+      const int rowTop = *std::max_element(rowHeights, rowHeights + WIDTH);
+      for (int y = bottom; y < bottom + SECTION_HEIGHT; ++y) {
+        //Caves only where some column of the row is still ground.
+        float cave[WIDTH] = {};
+        const bool ground = y > 0 && y < rowTop;
+        if (ground) {
+          fractalRow(m_seed ^ CAVE_SALT, x0, (float)y, (float)z, CAVE_FREQUENCY,
+                     CAVE_OCTAVES, cave);
+        }
+        unsigned char* row = out + ((y - bottom) * WIDTH + z) * WIDTH;
+        for (int x = 0; x < WIDTH; ++x) {
+          const int h = rowHeights[x];
+          const bool shore = h < SEA_LEVEL + 2;
+          unsigned char id;
+          if (y == 0) {
+            id = BEDROCK;
+          } else if (y > h) {
+            id = y <= SEA_LEVEL ? WATER : AIR;
+          } else if (y == h) {
+            id = shore ? SAND : GRASS;
+          } else if (y > h - SOIL_DEPTH) {
+            id = shore ? SAND : DIRT;
+          } else {
+            id = STONE;
+          }
+          if (ground && y < h && cave[x] > CAVE_THRESHOLD) {
+            id = AIR;
+          }
+          row[x] = id;
+        }
+      }
+    }
+  }
+
+  inline void Terrain::generate(int cx, unsigned char* out) const {
+    int heights[COLUMNS];
+    heightmap(cx, heights);
+    for (int s = 0; s < SECTION_COUNT; ++s) {
+      section(cx, heights, s, out + s * SECTION_BLOCKS);
+    }
+  }
+} //namespace matan
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+#endif //MATAN_TERRAIN_HH
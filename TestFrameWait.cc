@@ -0,0 +1,78 @@
+/*
+ * Checks that a frame task waiting inside the pool never helps with
+ * background work. Background tasks are queued up first, then frame tasks
+ * run parallel_for and wait(latch) over them, the latter for a latch only
+ * the main thread opens; every background task checks that the thread it
+ * runs on isn't inside such a wait. Each Scheduling in
+ * turn, and every background task must still run.
+ *
+ * Exits with 1 on failure.
+ *
+ * g++ -std=c++20 -O2 -pthread TestFrameWait.cc -o test_frame_wait
+ * ./test_frame_wait [frames]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "ThreadPool.hh"
+
+using namespace std;
+
+static constexpr int WORKERS = 4;
+static constexpr int BACKGROUND_TASKS = 2000;
+
+//Set while this thread's frame task waits.
+static thread_local bool t_frameWaiting = false;
+
+static void work(int microseconds) {
+  const auto end = chrono::steady_clock::now() + chrono::microseconds(microseconds);
+  while (chrono::steady_clock::now() < end) {
+  }
+}
+
+static bool run(matan::ThreadPool::Scheduling scheduling, const char* label, int frames) {
+  matan::ThreadPool pool(WORKERS, scheduling);
+  atomic_int inverted(0), background(0);
+  for (int i = 0; i < BACKGROUND_TASKS; ++i) {
+    pool.enqueue(matan::ThreadPool::Priority::Background, [&inverted, &background]() {
+      if (t_frameWaiting) {
+        ++inverted;
+      }
+      work(20);
+      ++background;
+    });
+  }
+  for (int f = 0; f < frames; ++f) {
+    matan::Latch frame(1), outside(1);
+    pool.enqueue(matan::ThreadPool::Priority::Frame, [&pool, &frame, &outside]() {
+      t_frameWaiting = true;
+      pool.parallel_for(0, 4 * WORKERS, 1, [](int) { work(50); },
+                        matan::ThreadPool::Partitioner::Dynamic);
+      //Nothing on the frame lane can open this one, so the wait finds the
+      //lane empty for as long as it lasts.
+      pool.wait(outside);
+      t_frameWaiting = false;
+      frame.countDown();
+    });
+    //Asleep, so the frame task gets the CPU even on a single core.
+    this_thread::sleep_for(chrono::microseconds(500));
+    outside.countDown();
+    frame.wait();
+  }
+  pool.waitFinished();
+  printf("%-12s %d frames, %d/%d background tasks run, %d inside a frame wait\n",
+         label, frames, background.load(), BACKGROUND_TASKS, inverted.load());
+  return inverted == 0 && background == BACKGROUND_TASKS;
+}
+
+int main(int argc, char* argv[]) {
+  const int frames = argc > 1 ? atoi(argv[1]) : 200;
+  bool ok = run(matan::ThreadPool::Scheduling::Shared, "Shared", frames);
+  ok = run(matan::ThreadPool::Scheduling::WorkStealing, "WorkStealing", frames) && ok;
+  ok = run(matan::ThreadPool::Scheduling::LockFree, "LockFree", frames) && ok;
+  printf(ok ? "ok\n" : "FAILED\n");
+  return ok ? 0 : 1;
+}
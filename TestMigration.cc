@@ -0,0 +1,73 @@
+/*
+ * Runs GameOnHeap_TP_NoRealloc's frames with every page of the chunk page
+ * pool taken, so chunks that fill the pages they have can't take in any
+ * more migrants, and checks that no entity goes missing: the world holds
+ * as many after every frame as it did before. Then gives the pages back
+ * and checks the turned away migrants get through.
+ *
+ * The player stands still, so no chunk is regenerated. Build with the
+ * game's -D flags to test those builds.
+ *
+ * Exits with 1 on failure.
+ *
+ * g++ -std=c++20 -O2 -pthread TestMigration.cc -o test_migration
+ * ./test_migration [frames]
+ */
+
+#define main gameMain
+#include "GameOnHeap_TP_NoRealloc.cpp"
+#undef main
+
+static long countEntities(const Game& game) {
+  long total = 0;
+  for (const Chunk* chunk : game.chunks) {
+    total += chunk->entities.size();
+  }
+  return total;
+}
+
+//Runs frames, false as soon as the world's entity count is not expected.
+static bool runFrames(Game& game, int frames, long expected, long& turnedAway) {
+  for (int f = 0; f < frames; ++f) {
+    game.updateChunks();
+    turnedAway += game.stats.entitiesTurnedAway;
+    const long total = countEntities(game);
+    if (total != expected) {
+      printf("frame %d: %ld entities, expected %ld\n", f, total, expected);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  const int frames = argc > 1 ? atoi(argv[1]) : 400;
+  auto game = new Game;
+  game->loadWorld();
+  const long expected = countEntities(*game);
+
+  std::vector<void*> taken;
+  while (void* page = Chunk::pagePool().allocate()) {
+    taken.push_back(page);
+  }
+  long turnedAway = 0;
+  bool ok = runFrames(*game, frames, expected, turnedAway);
+  printf("pool empty: %d frames, %ld entities, %ld migrants turned away\n",
+         frames, expected, turnedAway);
+  if (turnedAway == 0) {
+    printf("no migrant was turned away, the pool never ran dry where it mattered\n");
+    ok = false;
+  }
+
+  for (void* page : taken) {
+    Chunk::pagePool().release(page);
+  }
+  turnedAway = 0;
+  ok = ok && runFrames(*game, frames, expected, turnedAway);
+  printf("pool refilled: %ld migrants turned away\n", turnedAway);
+
+  printf(ok ? "ok\n" : "FAILED\n");
+  fflush(stdout);
+  //The game's workers never exit.
+  std::_Exit(ok ? 0 : 1);
+}
@@ -2,46 +2,394 @@
  * credit: WhozCraig on Stackoverflow
  * http://stackoverflow.com/questions/23896421/efficiently-waiting-for-all-m_tasks-in-a-threadpool-to-finish
  *
- * DOESN'T WORK :'(
+ * enqueue copies f and args into the task, like std::thread does, so it is
+ * fine to pass temporaries. Wrap anything that should be shared, or is too
+ * big for a Task, in std::ref.
+ *
+ * Three scheduling modes:
+ *  Shared       - every task goes through one deque behind m_queueMutex.
+ *  WorkStealing - each worker owns a deque. The owner pushes and pops at the
+ *                 back, idle workers steal from the front of the others.
+ *                 Submissions from outside the pool are dealt round robin.
+ *  LockFree     - like Shared, but the queue is a bounded MPMCQueue of
+ *                 queueCapacity tasks, allocated up front. A submitter that
+ *                 finds it full spins until there's room, running tasks
+ *                 itself meanwhile if it is one of the workers.
+ *
+ * parallel_for splits an index range into tasks. The Static partitioner
+ * recursively halves the range until there is one piece per worker, Dynamic
+ * and Guided start one task per worker that pull iterations off a shared
+ * counter, in fixed `grain` sized bites or in shrinking ones respectively.
+ * Affine cuts the same pieces as Static but queues piece k straight onto
+ * worker k, so a range keeps landing on the same worker call after call and
+ * the memory it first touched stays on that worker's NUMA node. Pieces can
+ * still be stolen when their worker is busy elsewhere.
+ *
+ * Every queue has a lane per Priority. Frame tasks are always taken before
+ * Background ones, from any queue, and waitFinished can wait for a single
+ * lane. Background work soaks up whatever the frame leaves idle, but once a
+ * worker has started a background task it runs it to the end. So a frame
+ * task waiting inside the pool (wait, parallel_for) only helps with frame
+ * work, or it could end up running a long background task while the frame
+ * waits on it.
+ *
+ * By default idle workers and waiters go straight to sleep on a condition
+ * variable. setSpinBudget makes them spin with backoff for that long first,
+ * which keeps workers hot between the phases of a frame at the price of
+ * burning that much CPU whenever they run out of work.
+ *
+ * There is no separate frame barrier mode for workers to spin at until the
+ * next frame releases them. Within a frame each phase is enqueued well inside
+ * the budget of the last one finishing, so the spin already is that barrier.
+ * Between frames the gap is milliseconds, and holding workers at a barrier
+ * that long would burn a core each to save the ~10us of a condition variable
+ * wake (see BenchWakeLatency.cc).
+ *
+ * Build with -DMATAN_THREADPOOL_STATS to have the pool keep count of where
+ * its time goes, see stats(). Without it the counters are never touched and
+ * stats() is all zeros.
  */
 
-#include <deque>
+#ifndef MATAN_THREADPOOL_HH
+#define MATAN_THREADPOOL_HH
+
 #include <thread>
 #include <condition_variable>
 #include <mutex>
 #include <atomic>
 #include <iostream>
 #include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <optional>
+#include <tuple>
+#include <utility>
+#include <chrono>
+#include <cstdint>
+#include "Task.hh"
+#include "MPMCQueue.hh"
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace matan {
+  inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+  }
+
+  /*
+   * Bounded exponential backoff for spin-then-park waits. Each spin() pauses
+   * twice as long as the last, up to a cap, and returns false once the
+   * budget is spent and it's time to park.
+   */
+  class Backoff {
+  public:
+    explicit Backoff(const std::chrono::nanoseconds budget) :
+        m_budget(budget), m_pauses(1), m_started(false) {}
+    bool spin();
+
+  private:
+    static constexpr int MAX_PAUSES = 64;
+    const std::chrono::nanoseconds m_budget;
+    std::chrono::steady_clock::time_point m_deadline;
+    int m_pauses;
+    bool m_started;
+  };
+
+  inline bool Backoff::spin() {
+    if (m_budget.count() <= 0) {
+      return false;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (!m_started) {
+      m_deadline = now + m_budget;
+      m_started = true;
+    } else if (now >= m_deadline) {
+      return false;
+    }
+    for (int i = 0; i < m_pauses; ++i) {
+      cpuRelax();
+    }
+    m_pauses = std::min(m_pauses * 2, MAX_PAUSES);
+    return true;
+  }
+
+  /*
+   * Single use countdown. Whoever takes the count to zero wakes the waiters.
+   *
+   * Latches usually live on the waiter's stack, so the count only ever drops
+   * under m_mutex. Once a waiter has seen zero and then held the mutex, the
+   * last countDown is done touching the latch and it may be destroyed.
+   */
+  class Latch {
+  public:
+    explicit Latch(const unsigned int count) : m_count(count) {}
+    //Only while nobody is waiting on, or counting down, the latch.
+    void reset(const unsigned int count) { m_count = count; };
+    void countDown();
+    bool tryWait();
+    //Spins for up to spin before sleeping.
+    void wait(std::chrono::nanoseconds spin = std::chrono::nanoseconds(0));
+
+  private:
+    std::atomic_uint m_count;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+  };
+
+  inline void Latch::countDown() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (--m_count == 0) {
+      m_cv.notify_all();
+    }
+  }
+
+  inline bool Latch::tryWait() {
+    if (m_count != 0) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return true;
+  }
+
+  inline void Latch::wait(std::chrono::nanoseconds spin) {
+    Backoff backoff(spin);
+    while (m_count != 0 && backoff.spin()) {
+    }
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this]() { return m_count == 0; });
+  }
+
+  /*
+   * Result slot for ThreadPool::submit. The caller owns it, usually on the
+   * stack, so getting a result back costs no allocation. Single use, unless
+   * reset() once the previous result has been collected.
+   */
+  template<class R>
+  class Completion : public Latch {
+  public:
+    Completion() : Latch(1) {}
+    void reset() { m_value.reset(); Latch::reset(1); };
+    R& get() { wait(); return *m_value; };
+
+  private:
+    friend class ThreadPool;
+    std::optional<R> m_value;
+  };
+
+  template<>
+  class Completion<void> : public Latch {
+  public:
+    Completion() : Latch(1) {}
+    void reset() { Latch::reset(1); };
+    void get() { wait(); };
+  };
+
   class ThreadPool {
   public:
-    ThreadPool(const unsigned int n = std::thread::hardware_concurrency());
+    enum class Scheduling { Shared, WorkStealing, LockFree };
+    enum class Partitioner { Static, Dynamic, Guided, Affine };
+    enum class Priority { Frame, Background };
+    static constexpr int LANES = 2;
+#ifdef MATAN_THREADPOOL_STATS
+    static constexpr bool STATS = true;
+#else
+    static constexpr bool STATS = false;
+#endif
+
+    /*
+     * Counters since construction or the last resetStats(). Intervals are
+     * booked when they end, so a worker asleep across a reset books its whole
+     * nap afterwards. Time a worker spends helping inside wait() counts as
+     * busy, it is still inside the task that waits.
+     */
+    struct Stats {
+      struct Worker {
+        std::chrono::nanoseconds busy;   //running tasks
+        std::chrono::nanoseconds idle;   //spinning or asleep
+        std::uint64_t tasks;
+      };
+      std::vector<Worker> workers;
+      unsigned int queueHighWater;       //most tasks queued at once
+      std::uint64_t started;             //tasks taken off a queue
+      std::chrono::nanoseconds totalStartLatency;  //enqueue to start, summed
+      std::chrono::nanoseconds maxStartLatency;
+      //Threads outside the pool blocked in waitFinished or wait(latch).
+      std::chrono::nanoseconds waitStall;
+    };
+
+    //n workers, at least 1.
+    ThreadPool(const unsigned int n = std::thread::hardware_concurrency(),
+               const Scheduling scheduling = Scheduling::Shared,
+               const std::size_t queueCapacity = 4096);
     ~ThreadPool();
     int numThreads() const { return m_workers.size(); };
+    Scheduling scheduling() const { return m_scheduling; };
     template<class F, class... Args> void enqueue(F &&f, Args&&... args);
+    template<class F, class... Args>
+    void enqueue(Priority priority, F &&f, Args&&... args);
+    /*
+     * Like enqueue, but the return value of f lands in result, which opens
+     * once it is there. result must outlive the task.
+     */
+    template<class R, class F, class... Args>
+    void submit(Completion<R>& result, F&& f, Args&&... args);
     void waitFinished();
+    //Only waits for the tasks of one lane, the others may still be running.
+    void waitFinished(Priority priority);
+    /*
+     * How long idle workers, waitFinished and wait(latch) spin before they
+     * sleep. 0, the default, sleeps straight away.
+     */
+    void setSpinBudget(std::chrono::nanoseconds budget) { m_spinBudget = budget.count(); };
+    std::chrono::nanoseconds spinBudget() const { return std::chrono::nanoseconds(m_spinBudget); };
+    /*
+     * Calls fn(i) for every i in [begin, end) and returns once they all have.
+     * No piece is smaller than grain, apart from the tail. Safe to call from
+     * inside a task, the calling worker runs other tasks while it waits.
+     */
+    template<class F>
+    void parallel_for(int begin, int end, int grain, F&& fn,
+                      Partitioner partitioner = Partitioner::Static);
+    /*
+     * Block until the latch opens. Workers of this pool keep executing tasks
+     * meanwhile instead of sleeping, so nested waits can't starve the pool;
+     * inside a frame task, only frame tasks.
+     */
+    void wait(Latch& latch);
+    /*
+     * Pin worker i to cpus[i % cpus.size()], see Topology for layouts.
+     * Returns false if the platform can't, or any of the calls failed.
+     */
+    bool pinWorkers(const std::vector<int>& cpus);
+    /*
+     * Index of the calling thread among this pool's workers, or -1 when
+     * called from a thread the pool doesn't own.
+     */
+    int currentWorker() const;
+    //Snapshot of the counters. Cheap enough to call once a frame.
+    Stats stats() const;
+    void resetStats();
 
   private:
+    struct WorkerQueue {
+      std::mutex mutex;
+      TaskQueue tasks[LANES];
+    };
+
+    typedef std::chrono::steady_clock Clock;
+
+    //Each worker writes only its own, on its own cache line.
+    struct alignas(64) WorkerStats {
+      std::atomic<std::int64_t> busy{0};
+      std::atomic<std::int64_t> idle{0};
+      std::atomic<std::uint64_t> tasks{0};
+      int depth = 0;  //tasks nested on this worker's stack, owner only
+    };
+
+    struct WorkerId {
+      const ThreadPool* pool = nullptr;
+      int index = -1;
+      int lane = -1;  //of the task it's running, innermost if nested
+    };
+
     std::vector<std::thread> m_workers;
-    std::deque<std::function<void()>> m_tasks;
+    TaskQueue m_tasks[LANES];
     std::mutex m_queueMutex;
     std::condition_variable m_cvTask;
     std::condition_variable m_cvFinished;
-    int m_busy;
-    bool stop;
+    std::atomic_bool stop;
 
-    void threadProc();
+    const Scheduling m_scheduling;
+    std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+    std::vector<std::unique_ptr<MPMCQueue<Task>>> m_rings;
+    std::atomic_uint m_pending;            //tasks sitting in any queue
+    std::atomic_uint m_unfinished[LANES];  //tasks enqueued and not yet returned
+    std::atomic<std::chrono::nanoseconds::rep> m_spinBudget;
+    std::atomic_uint m_sleeping;
+    std::atomic_uint m_nextQueue;
+
+    std::unique_ptr<WorkerStats[]> m_workerStats;
+    std::atomic_uint m_queueHighWater;
+    std::atomic<std::uint64_t> m_started;
+    std::atomic<std::int64_t> m_startLatency;
+    std::atomic<std::int64_t> m_maxStartLatency;
+    std::atomic<std::int64_t> m_waitStall;
+
+    static WorkerId& self();
+    template<class F>
+    void splitStatic(int begin, int end, int pieces, F& fn, Latch& latch);
+    void schedule(Task task, Priority priority = Priority::Frame);
+    //Runs a task from the first lanes lanes, false if there was none.
+    bool runOne(int lanes = LANES);
+    //Lanes a worker may help with while its current task waits: the task's
+    //own and the ones ahead of it.
+    int helpLanes() const;
+    void runTask(Task& task, int lane);
+    void finished(int lane);
+    void push(Task task, int lane);
+    void pushTo(unsigned int index, Task task, int lane);
+    void pushRing(Task task, int lane);
+    void notifySleeper();
+    int popShared(Task& task, int lanes = LANES);
+    bool popLocal(unsigned int index, int lane, Task& task);
+    bool steal(unsigned int index, int lane, Task& task);
+    void threadProc(unsigned int index);
+    void workerProc(unsigned int index);
+
+    //All of these compile to nothing without MATAN_THREADPOOL_STATS.
+    static Clock::time_point statsNow();
+    static void stamp(Task& task);
+    void countQueued(unsigned int depth);
+    void countIdle(unsigned int index, Clock::time_point since);
+    void countStall(Clock::time_point since);
+    static void raise(std::atomic<std::int64_t>& max, std::int64_t value);
   };
 
-  ThreadPool::ThreadPool(unsigned int n) :
-          m_busy(0), stop(false) {
+  inline ThreadPool::ThreadPool(unsigned int n, Scheduling scheduling,
+                                std::size_t queueCapacity) :
+          stop(false), m_scheduling(scheduling),
+          m_pending(0), m_spinBudget(0),
+          m_sleeping(0), m_nextQueue(0),
+          m_queueHighWater(0), m_started(0), m_startLatency(0),
+          m_maxStartLatency(0), m_waitStall(0) {
+    //hardware_concurrency() is 0 when it can't tell.
+    n = std::max(n, 1u);
+    for (auto& unfinished : m_unfinished) {
+      unfinished = 0;
+    }
+    if (STATS) {
+      m_workerStats.reset(new WorkerStats[n]);
+    }
+    if (m_scheduling == Scheduling::Shared) {
+      for (unsigned int i = 0; i < n; ++i) {
+        m_workers.emplace_back([this, i](){this->threadProc(i);});
+      }
+      return;
+    }
+
+    //All the queues must exist before any worker starts looking at them.
+    if (m_scheduling == Scheduling::LockFree) {
+      for (int lane = 0; lane < LANES; ++lane) {
+        m_rings.emplace_back(new MPMCQueue<Task>(queueCapacity));
+      }
+    } else {
+      for (unsigned int i = 0; i < n; ++i) {
+        m_queues.emplace_back(new WorkerQueue);
+      }
+    }
     for (unsigned int i = 0; i < n; ++i) {
-      m_workers.emplace_back([this](){this->threadProc();});
+      m_workers.emplace_back([this, i](){this->workerProc(i);});
     }
   }
 
-  ThreadPool::~ThreadPool() {
+  inline ThreadPool::~ThreadPool() {
     std::unique_lock<std::mutex> lock(m_queueMutex);
     stop = true;
     m_cvTask.notify_all();
@@ -52,50 +400,501 @@ namespace matan {
     }
   }
 
+  inline ThreadPool::WorkerId& ThreadPool::self() {
+    static thread_local WorkerId id;
+    return id;
+  }
+
+  inline int ThreadPool::currentWorker() const {
+    const WorkerId& id = self();
+    return id.pool == this ? id.index : -1;
+  }
+
   template<class F, class... Args>
   void ThreadPool::enqueue(F&& f, Args&&... args) {
+    schedule([f = std::forward<F>(f),
+              args = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+      std::apply(f, args);
+    });
+  }
+
+  template<class F, class... Args>
+  void ThreadPool::enqueue(Priority priority, F&& f, Args&&... args) {
+    schedule([f = std::forward<F>(f),
+              args = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+      std::apply(f, args);
+    }, priority);
+  }
+
+  template<class R, class F, class... Args>
+  void ThreadPool::submit(Completion<R>& result, F&& f, Args&&... args) {
+    schedule([&result,
+              f = std::forward<F>(f),
+              args = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+      if constexpr (std::is_void<R>::value) {
+        std::apply(f, args);
+      } else {
+        result.m_value.emplace(std::apply(f, args));
+      }
+      result.countDown();
+    });
+  }
+
+  inline void ThreadPool::schedule(Task task, Priority priority) {
+    const int lane = static_cast<int>(priority);
+    if (m_scheduling == Scheduling::WorkStealing) {
+      push(std::move(task), lane);
+      return;
+    }
+    if (m_scheduling == Scheduling::LockFree) {
+      pushRing(std::move(task), lane);
+      return;
+    }
+
+    stamp(task);
     std::unique_lock<std::mutex> lock(m_queueMutex);
-    auto func = [&f, &args...](){ f(args...); };
-    m_tasks.emplace_back(func);
+    ++m_unfinished[lane];
+    m_tasks[lane].push_back(std::move(task));
+    countQueued(++m_pending);
     m_cvTask.notify_one();
   }
 
-  void ThreadPool::waitFinished() {
+  template<class F>
+  void ThreadPool::parallel_for(int begin, int end, int grain, F&& fn,
+                                Partitioner partitioner) {
+    if (begin >= end) {
+      return;
+    }
+    grain = std::max(grain, 1);
+    const int iterations = end - begin;
+    const int tasks = std::min(std::max(numThreads(), 1),
+                               (iterations + grain - 1) / grain);
+    Latch latch(tasks);
+
+    if (partitioner == Partitioner::Affine &&
+        m_scheduling == Scheduling::WorkStealing) {
+      for (int piece = 0; piece < tasks; ++piece) {
+        const int first = begin + (long)iterations * piece / tasks;
+        const int last = begin + (long)iterations * (piece + 1) / tasks;
+        pushTo(piece, [first, last, &fn, &latch]() {
+          for (int i = first; i < last; ++i) {
+            fn(i);
+          }
+          latch.countDown();
+        }, static_cast<int>(Priority::Frame));
+      }
+      wait(latch);
+      return;
+    }
+
+    if (partitioner == Partitioner::Static ||
+        partitioner == Partitioner::Affine) {
+      schedule([this, begin, end, tasks, &fn, &latch]() {
+        splitStatic(begin, end, tasks, fn, latch);
+      });
+      wait(latch);
+      return;
+    }
+
+    std::atomic_int next(begin);
+    auto loop = [partitioner, end, grain, tasks, &next, &fn, &latch]() {
+      while (true) {
+        int first = next.load();
+        int size = grain;
+        if (partitioner == Partitioner::Guided) {
+          size = std::max(grain, (end - first) / (2 * tasks));
+        }
+        //Guided sizes depend on first, so claim with a CAS, not a fetch_add.
+        while (first < end &&
+               !next.compare_exchange_weak(first, first + size)) {
+          if (partitioner == Partitioner::Guided) {
+            size = std::max(grain, (end - first) / (2 * tasks));
+          }
+        }
+        if (first >= end) {
+          break;
+        }
+        const int last = std::min(first + size, end);
+        for (int i = first; i < last; ++i) {
+          fn(i);
+        }
+      }
+      latch.countDown();
+    };
+    for (int t = 0; t < tasks; ++t) {
+      schedule(loop);
+    }
+    wait(latch);
+  }
+
+  template<class F>
+  void ThreadPool::splitStatic(int begin, int end, int pieces,
+                               F& fn, Latch& latch) {
+    //Hand the right half to the queue, where an idle worker can steal it.
+    while (pieces > 1) {
+      const int right = pieces / 2;
+      const int mid = begin + (long)(end - begin) * (pieces - right) / pieces;
+      schedule([this, mid, end, right, &fn, &latch]() {
+        splitStatic(mid, end, right, fn, latch);
+      });
+      end = mid;
+      pieces -= right;
+    }
+
+    for (int i = begin; i < end; ++i) {
+      fn(i);
+    }
+    latch.countDown();
+  }
+
+  inline void ThreadPool::wait(Latch& latch) {
+    if (currentWorker() < 0) {
+      const auto since = statsNow();
+      latch.wait(spinBudget());
+      countStall(since);
+      return;
+    }
+
+    const int lanes = helpLanes();
+    while (!latch.tryWait()) {
+      if (!runOne(lanes)) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  inline int ThreadPool::helpLanes() const {
+    const int lane = self().lane;
+    return lane < 0 ? LANES : lane + 1;
+  }
+
+  inline bool ThreadPool::runOne(int lanes) {
+    Task task;
+    int lane = -1;
+    if (m_scheduling == Scheduling::WorkStealing) {
+      //Our own frame work, anyone's frame work, then the same for background.
+      const int index = currentWorker();
+      for (int l = 0; l < lanes && lane < 0; ++l) {
+        if (popLocal(index, l, task) || steal(index, l, task)) {
+          lane = l;
+        }
+      }
+    } else if (m_scheduling == Scheduling::LockFree) {
+      for (int l = 0; l < lanes && lane < 0; ++l) {
+        if (m_rings[l]->tryPop(task)) {
+          --m_pending;
+          lane = l;
+        }
+      }
+    } else {
+      std::lock_guard<std::mutex> lock(m_queueMutex);
+      lane = popShared(task, lanes);
+    }
+    if (lane < 0) {
+      return false;
+    }
+
+    runTask(task, lane);
+    return true;
+  }
+
+  inline void ThreadPool::runTask(Task& task, int lane) {
+    const int outer = std::exchange(self().lane, lane);
+#ifdef MATAN_THREADPOOL_STATS
+    const auto start = Clock::now();
+    const std::int64_t latency =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(start - task.enqueued).count();
+    ++m_started;
+    m_startLatency += latency;
+    raise(m_maxStartLatency, latency);
+
+    WorkerStats& worker = m_workerStats[currentWorker()];
+    ++worker.depth;
+    task();
+    //Nested tasks already sit inside the outer one's busy time.
+    if (--worker.depth == 0) {
+      worker.busy += std::chrono::duration_cast<std::chrono::nanoseconds>(
+          Clock::now() - start).count();
+    }
+    ++worker.tasks;
+#else
+    task();
+#endif
+    self().lane = outer;
+    finished(lane);
+  }
+
+  inline void ThreadPool::finished(int lane) {
+    if (--m_unfinished[lane] == 0) {
+      /*
+       * Need to lock this section so that don't make 'final' call of
+       * m_cvFinished.notify_all(), while waitFinished is between checking
+       * its predicate and going to sleep. The notify would go unnoticed and
+       * it would never again be notified.
+       */
+      std::lock_guard<std::mutex> lock(m_queueMutex);
+      m_cvFinished.notify_all();
+    }
+  }
+
+  inline void ThreadPool::push(Task task, int lane) {
+    int index = currentWorker();
+    if (index < 0) {
+      index = m_nextQueue++ % m_queues.size();
+    }
+    pushTo(index, std::move(task), lane);
+  }
+
+  inline void ThreadPool::pushTo(unsigned int index, Task task, int lane) {
+    ++m_unfinished[lane];
+    WorkerQueue& queue = *m_queues[index];
+    stamp(task);
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks[lane].push_back(std::move(task));
+      countQueued(++m_pending);
+    }
+    notifySleeper();
+  }
+
+  inline void ThreadPool::pushRing(Task task, int lane) {
+    ++m_unfinished[lane];
+    //Counted before it's visible, so m_pending can't dip below zero.
+    countQueued(++m_pending);
+    stamp(task);
+    MPMCQueue<Task>& ring = *m_rings[lane];
+    while (!ring.tryPush(std::move(task))) {
+      //Full. A worker waiting for room could be waiting on itself.
+      if (currentWorker() < 0 || !runOne(helpLanes())) {
+        std::this_thread::yield();
+      }
+    }
+    notifySleeper();
+  }
+
+  inline void ThreadPool::notifySleeper() {
+    /*
+     * Only touch the shared mutex if someone may be asleep. A worker bumps
+     * m_sleeping before it checks m_pending, and we bumped m_pending before
+     * checking m_sleeping, so at least one of us sees the other.
+     */
+    if (m_sleeping > 0) {
+      std::lock_guard<std::mutex> lock(m_queueMutex);
+      m_cvTask.notify_one();
+    }
+  }
+
+  //Caller holds m_queueMutex.
+  inline int ThreadPool::popShared(Task& task, int lanes) {
+    for (int lane = 0; lane < lanes; ++lane) {
+      if (!m_tasks[lane].empty()) {
+        task = m_tasks[lane].pop_front();
+        --m_pending;
+        return lane;
+      }
+    }
+    return -1;
+  }
+
+  inline bool ThreadPool::popLocal(unsigned int index, int lane, Task& task) {
+    WorkerQueue& queue = *m_queues[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks[lane].empty()) {
+      return false;
+    }
+    task = queue.tasks[lane].pop_back();
+    --m_pending;
+    return true;
+  }
+
+  inline bool ThreadPool::steal(unsigned int index, int lane, Task& task) {
+    const unsigned int n = m_queues.size();
+    for (unsigned int i = 1; i < n; ++i) {
+      WorkerQueue& victim = *m_queues[(index + i) % n];
+      std::unique_lock<std::mutex> lock(victim.mutex, std::try_to_lock);
+      if (!lock.owns_lock() || victim.tasks[lane].empty()) {
+        continue;
+      }
+      task = victim.tasks[lane].pop_front();
+      --m_pending;
+      return true;
+    }
+    return false;
+  }
+
+  inline bool ThreadPool::pinWorkers(const std::vector<int>& cpus) {
+#ifdef __linux__
+    if (cpus.empty()) {
+      return false;
+    }
+    bool pinned = true;
+    for (std::size_t i = 0; i < m_workers.size(); ++i) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpus[i % cpus.size()], &set);
+      pinned &= pthread_setaffinity_np(m_workers[i].native_handle(),
+                                       sizeof(set), &set) == 0;
+    }
+    return pinned;
+#else
+    return false;
+#endif
+  }
+
+  inline void ThreadPool::waitFinished() {
+    for (int lane = 0; lane < LANES; ++lane) {
+      waitFinished(static_cast<Priority>(lane));
+    }
+  }
+
+  inline void ThreadPool::waitFinished(Priority priority) {
+    std::atomic_uint& unfinished = m_unfinished[static_cast<int>(priority)];
+    const auto since = statsNow();
+    Backoff backoff(spinBudget());
+    while (unfinished != 0 && backoff.spin()) {
+    }
+
     std::unique_lock<std::mutex> lock(m_queueMutex);
-    m_cvFinished.wait(lock,
-                      [this]() {
-                        return m_tasks.empty() && (m_busy == 0);
-                      });
-    m_busy = 0;
+    m_cvFinished.wait(lock, [&unfinished]() { return unfinished == 0; });
+    lock.unlock();
+    countStall(since);
   }
 
-  void ThreadPool::threadProc() {
+  inline void ThreadPool::threadProc(unsigned int index) {
+    self().pool = this;
+    self().index = index;
+
     while (true) {
+      const auto idleSince = statsNow();
+      Backoff backoff(spinBudget());
+      while (m_pending == 0 && !stop && backoff.spin()) {
+      }
+
       std::unique_lock<std::mutex> lock(m_queueMutex);
-      m_cvTask.wait(lock, [this]() { return stop || !m_tasks.empty(); });
-      if (!m_tasks.empty()) {
-        ++m_busy;
-        auto fn = m_tasks.front();
-        m_tasks.pop_front();
+      m_cvTask.wait(lock, [this]() { return stop || m_pending > 0; });
+      Task fn;
+      const int lane = popShared(fn);
+      if (lane >= 0) {
         lock.unlock();
+        countIdle(index, idleSince);
 
         //run the function without blocking the other threads
-        fn();
-
-        lock.lock();
-        /*
-         * Need to lock this section so that don't make 'final' call of
-         * m_cvFinished.notify_one(), while another one is previously running.
-         * This will cause the notify to go unnoticed, beacause we won't be
-         * waiting at this point, and then will never again be notified.
-         */
-        --m_busy;
-        m_cvFinished.notify_one();
-        lock.unlock();
+        runTask(fn, lane);
       } else if (stop) {
         break;
       }
     }
   }
 
+  //Worker loop for WorkStealing and LockFree.
+  inline void ThreadPool::workerProc(unsigned int index) {
+    self().pool = this;
+    self().index = index;
+
+    while (true) {
+      if (runOne()) {
+        continue;
+      }
+      const auto idleSince = statsNow();
+      Backoff backoff(spinBudget());
+      while (m_pending == 0 && !stop && backoff.spin()) {
+      }
+      if (m_pending > 0) {
+        countIdle(index, idleSince);
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(m_queueMutex);
+      ++m_sleeping;
+      m_cvTask.wait(lock, [this]() { return stop || m_pending > 0; });
+      --m_sleeping;
+      if (stop && m_pending == 0) {
+        break;
+      }
+      lock.unlock();
+      countIdle(index, idleSince);
+    }
+  }
+
+  inline ThreadPool::Stats ThreadPool::stats() const {
+    using std::chrono::nanoseconds;
+    Stats stats = {};
+    if (STATS) {
+      for (std::size_t i = 0; i < m_workers.size(); ++i) {
+        const WorkerStats& worker = m_workerStats[i];
+        stats.workers.push_back({nanoseconds(worker.busy.load()),
+                                 nanoseconds(worker.idle.load()),
+                                 worker.tasks.load()});
+      }
+    }
+    stats.queueHighWater = m_queueHighWater;
+    stats.started = m_started;
+    stats.totalStartLatency = nanoseconds(m_startLatency.load());
+    stats.maxStartLatency = nanoseconds(m_maxStartLatency.load());
+    stats.waitStall = nanoseconds(m_waitStall.load());
+    return stats;
+  }
+
+  inline void ThreadPool::resetStats() {
+    if (STATS) {
+      for (std::size_t i = 0; i < m_workers.size(); ++i) {
+        m_workerStats[i].busy = 0;
+        m_workerStats[i].idle = 0;
+        m_workerStats[i].tasks = 0;
+      }
+    }
+    //Whatever is queued right now is the new high water.
+    m_queueHighWater = STATS ? m_pending.load() : 0;
+    m_started = 0;
+    m_startLatency = 0;
+    m_maxStartLatency = 0;
+    m_waitStall = 0;
+  }
+
+  inline ThreadPool::Clock::time_point ThreadPool::statsNow() {
+    if (STATS) {
+      return Clock::now();
+    }
+    return Clock::time_point();
+  }
+
+  inline void ThreadPool::stamp([[maybe_unused]] Task& task) {
+#ifdef MATAN_THREADPOOL_STATS
+    task.enqueued = Clock::now();
+#endif
+  }
+
+  inline void ThreadPool::countQueued(unsigned int depth) {
+    if (STATS) {
+      unsigned int high = m_queueHighWater.load(std::memory_order_relaxed);
+      while (depth > high &&
+             !m_queueHighWater.compare_exchange_weak(high, depth,
+                                                     std::memory_order_relaxed)) {
+      }
+    }
+  }
+
+  inline void ThreadPool::countIdle(unsigned int index, Clock::time_point since) {
+    if (STATS) {
+      m_workerStats[index].idle += std::chrono::duration_cast<std::chrono::nanoseconds>(
+          Clock::now() - since).count();
+    }
+  }
+
+  inline void ThreadPool::countStall(Clock::time_point since) {
+    if (STATS) {
+      m_waitStall += std::chrono::duration_cast<std::chrono::nanoseconds>(
+          Clock::now() - since).count();
+    }
+  }
+
+  inline void ThreadPool::raise(std::atomic<std::int64_t>& max, std::int64_t value) {
+    std::int64_t current = max.load(std::memory_order_relaxed);
+    while (value > current &&
+           !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+  }
+
 } //namespace matan
+
+#endif //MATAN_THREADPOOL_HH
@@ -0,0 +1,138 @@
+/*
+ * Which CPUs sit on which NUMA node, read from sysfs, and worker layouts
+ * built from that for ThreadPool::pinWorkers.
+ *
+ * Only CPUs this process may run on are listed. Without sysfs (or off Linux)
+ * everything is treated as a single node.
+ */
+
+#ifndef MATAN_TOPOLOGY_HH
+#define MATAN_TOPOLOGY_HH
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace matan {
+  class Topology {
+  public:
+    //CPUs of each node, in ascending order.
+    std::vector<std::vector<int>> nodes;
+
+    static Topology detect();
+    int cpuCount() const;
+    //Fill node 0 first, then node 1... Neighbouring workers share a node.
+    std::vector<int> compactLayout(unsigned int workers) const;
+    //Deal workers round robin over the nodes, to spread memory bandwidth.
+    std::vector<int> scatterLayout(unsigned int workers) const;
+
+  private:
+    //sysfs's lists of CPUs or nodes, "0-3,8-11".
+    static std::vector<int> parseList(const std::string& list);
+    static std::vector<int> readList(const std::string& path);
+  };
+
+  inline std::vector<int> Topology::parseList(const std::string& list) {
+    std::vector<int> ids;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+      if (range.empty() || range == "\n") {
+        continue;
+      }
+      const std::size_t dash = range.find('-');
+      const int first = std::stoi(range.substr(0, dash));
+      const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      for (int id = first; id <= last; ++id) {
+        ids.push_back(id);
+      }
+    }
+    return ids;
+  }
+
+  //Empty if there's no such file.
+  inline std::vector<int> Topology::readList(const std::string& path) {
+    std::ifstream file(path);
+    std::string list;
+    std::getline(file, list);
+    return parseList(list);
+  }
+
+  inline Topology Topology::detect() {
+    Topology topology;
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    const bool haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    //Node ids can have gaps, e.g. "0,2" with node 1 offline.
+    for (int node : readList("/sys/devices/system/node/online")) {
+      std::vector<int> cpus;
+      for (int cpu : readList("/sys/devices/system/node/node" +
+                              std::to_string(node) + "/cpulist")) {
+        if (!haveMask || CPU_ISSET(cpu, &allowed)) {
+          cpus.push_back(cpu);
+        }
+      }
+      if (!cpus.empty()) {
+        topology.nodes.push_back(cpus);
+      }
+    }
+
+    if (topology.nodes.empty() && haveMask) {
+      std::vector<int> cpus;
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed)) {
+          cpus.push_back(cpu);
+        }
+      }
+      topology.nodes.push_back(cpus);
+    }
+#endif
+    if (topology.nodes.empty()) {
+      std::vector<int> cpus;
+      for (unsigned int cpu = 0; cpu < std::thread::hardware_concurrency(); ++cpu) {
+        cpus.push_back(cpu);
+      }
+      topology.nodes.push_back(cpus);
+    }
+    return topology;
+  }
+
+  inline int Topology::cpuCount() const {
+    int count = 0;
+    for (auto& node : nodes) {
+      count += node.size();
+    }
+    return count;
+  }
+
+  inline std::vector<int> Topology::compactLayout(unsigned int workers) const {
+    std::vector<int> all;
+    for (auto& node : nodes) {
+      all.insert(all.end(), node.begin(), node.end());
+    }
+    std::vector<int> layout;
+    for (unsigned int i = 0; i < workers && !all.empty(); ++i) {
+      layout.push_back(all[i % all.size()]);
+    }
+    return layout;
+  }
+
+  inline std::vector<int> Topology::scatterLayout(unsigned int workers) const {
+    std::vector<int> layout;
+    std::vector<std::size_t> next(nodes.size(), 0);
+    for (unsigned int i = 0; i < workers && !nodes.empty(); ++i) {
+      const std::size_t node = i % nodes.size();
+      layout.push_back(nodes[node][next[node]++ % nodes[node].size()]);
+    }
+    return layout;
+  }
+} //namespace matan
+
+#endif //MATAN_TOPOLOGY_HH
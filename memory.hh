@@ -1,3 +1,12 @@
+#ifndef MATAN_MEMORY_HH
+#define MATAN_MEMORY_HH
+
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
 namespace matan {
   template <typename T, typename... Args>
   inline void place(T* loc, Args&&... args) {
@@ -9,4 +18,104 @@ namespace matan {
     p->~T();
     ::new (p) T(args...);
   }
+
+  /*
+   * Objects of T in slabs of SLAB_SIZE, recycled through a free list instead
+   * of being destroyed. A released T stays constructed, and the next
+   * acquire(args...) hands it back through T::reset(args...), which only has
+   * to rewrite what differs from a fresh T(args...). So once the pool has
+   * grown to the most Ts live at once, churning them costs no allocation,
+   * constructor or destructor; and the last one released is the first one
+   * back, still warm in cache.
+   *
+   * Objects never move. Everything left is destroyed with the pool.
+   * acquire and release may be called from any thread.
+   */
+  template <typename T, int SLAB_SIZE = 16>
+  class SlabPool {
+  public:
+    SlabPool() = default;
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+    ~SlabPool();
+    //A released T reset(args...) if there is one, otherwise a new T(args...).
+    template <typename... Args> T* acquire(Args&&... args);
+    //p must have come from acquire, and is not to be used until it does again.
+    void release(T* p);
+    //Ts constructed so far, live or released.
+    int constructed();
+    int available();
+    int slabs();
+
+  private:
+    struct Slot {
+      alignas(T) unsigned char bytes[sizeof(T)];
+    };
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<Slot[]>> m_slabs;
+    int m_constructed = 0;
+    //Room for every T constructed, so release never allocates.
+    std::vector<T*> m_free;
+  };
+
+  template <typename T, int SLAB_SIZE>
+  SlabPool<T, SLAB_SIZE>::~SlabPool() {
+    for (int i = 0; i < m_constructed; ++i) {
+      reinterpret_cast<T*>(m_slabs[i / SLAB_SIZE][i % SLAB_SIZE].bytes)->~T();
+    }
+  }
+
+  template <typename T, int SLAB_SIZE>
+  template <typename... Args>
+  T* SlabPool<T, SLAB_SIZE>::acquire(Args&&... args) {
+    T* recycled = nullptr;
+    void* fresh = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (!m_free.empty()) {
+        recycled = m_free.back();
+        m_free.pop_back();
+      } else {
+        if (m_constructed == (int)m_slabs.size() * SLAB_SIZE) {
+          m_slabs.emplace_back(new Slot[SLAB_SIZE]);
+          m_free.reserve(m_slabs.size() * SLAB_SIZE);
+        }
+        fresh = m_slabs[m_constructed / SLAB_SIZE][m_constructed % SLAB_SIZE].bytes;
+        ++m_constructed;
+      }
+    }
+    //Outside the lock, it's ours either way.
+    if (recycled) {
+      recycled->reset(std::forward<Args>(args)...);
+      return recycled;
+    }
+    return ::new (fresh) T(std::forward<Args>(args)...);
+  }
+
+  template <typename T, int SLAB_SIZE>
+  void SlabPool<T, SLAB_SIZE>::release(T* p) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_free.push_back(p);
+  }
+
+  template <typename T, int SLAB_SIZE>
+  int SlabPool<T, SLAB_SIZE>::constructed() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_constructed;
+  }
+
+  template <typename T, int SLAB_SIZE>
+  int SlabPool<T, SLAB_SIZE>::available() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_free.size();
+  }
+
+  template <typename T, int SLAB_SIZE>
+  int SlabPool<T, SLAB_SIZE>::slabs() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_slabs.size();
+  }
 }
+
+#endif //MATAN_MEMORY_HH